@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Feeds client requests to Connection::processRequest(), as read by
+// Connection::run(), with a simulated inverter behind the server.
+//
+// The connection is created once and lives across inputs, so options set by
+// one request (format, delta, ...) apply to the following ones, as they would
+// within a real session.
+
+#include <cstring>
+#include <memory>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "src/server/server.h"
+#include "src/server/connection.h"
+#include "src/voltronic/device.h"
+
+// same as in Connection::run()
+static const size_t REQUEST_BUF_SIZE = 2048;
+
+static server::Connection* create_connection() {
+    auto device = std::make_shared<voltronic::SimulatedDevice>();
+    auto srv = new server::Server(device);
+
+    // the connection reads from its end in the background; nothing is ever
+    // written to the other one, so it just waits there while we call
+    // processRequest() directly
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        abort();
+
+    struct sockaddr_storage addr = {0};
+    auto in = reinterpret_cast<struct sockaddr_in*>(&addr);
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    return new server::Connection(sv[0], addr, srv);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static server::Connection* conn = create_connection();
+
+    if (size > REQUEST_BUF_SIZE - 1)
+        size = REQUEST_BUF_SIZE - 1;
+
+    char buf[REQUEST_BUF_SIZE];
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+
+    server::Response resp = conn->processRequest(buf);
+
+    std::ostringstream out;
+    out << resp;
+
+    return 0;
+}
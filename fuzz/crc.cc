@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// crc_calculate() must never produce bytes that the protocol reserves for
+// framing, and crc_write()/crc_read() must round-trip whatever it produces.
+
+#include <cstdlib>
+
+#include "src/voltronic/crc.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    voltronic::CRC crc = voltronic::crc_calculate(data, size);
+
+    if (size == 0) {
+        if (crc != 0)
+            abort();
+        return 0;
+    }
+
+    u8 buf[2];
+    voltronic::crc_write(crc, buf);
+    if (voltronic::crc_is_reserved(buf[0]) || voltronic::crc_is_reserved(buf[1]))
+        abort();
+
+    if (voltronic::crc_read(buf) != crc)
+        abort();
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Feeds device responses to the P18 decoders the way Client::execute() does.
+// The first byte of the input picks the command (by command_index()), the rest
+// is the frame as read from the device.
+
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include "src/p18/client.h"
+#include "src/p18/exceptions.h"
+#include "src/p18/functions.h"
+#include "src/p18/response.h"
+#include "src/formatter/formatter.h"
+
+static p18::CommandType command_from_index(size_t index) {
+    if (index < p18::GET_COMMANDS_COUNT)
+        return static_cast<p18::CommandType>(index);
+    return static_cast<p18::CommandType>(static_cast<size_t>(p18::CommandType::SetACSupply)
+                                         + index - p18::GET_COMMANDS_COUNT);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size < 1)
+        return 0;
+
+    p18::CommandType commandType = command_from_index(data[0] % p18::COMMANDS_COUNT);
+    data++;
+    size--;
+
+    // exactly as big as the frame, so that ASan catches reads past its end
+    std::shared_ptr<char> raw(new char[size ? size : 1], std::default_delete<char[]>());
+    memcpy(raw.get(), data, size);
+
+    auto response = p18::Client::createResponse(commandType, raw, size);
+    if (!response->validate())
+        return 0;
+
+    // same as in Client::execute(), anything else is a bug
+    try {
+        response->unpack();
+    }
+    catch (p18::InvalidResponseError& e) {
+        return 0;
+    }
+    catch (std::logic_error& e) {
+        return 0;
+    }
+
+    for (auto format: {formatter::Format::Table,
+                       formatter::Format::SimpleTable,
+                       formatter::Format::JSON,
+                       formatter::Format::SimpleJSON}) {
+        std::ostringstream buf;
+        buf << *(response->format(format).get());
+    }
+
+    return 0;
+}
@@ -1,7 +1,14 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include "common.h"
+#include "state.h"
+#include "logging.h"
+#include "p18/client.h"
+#include "voltronic/exceptions.h"
+#include "p18/exceptions.h"
+
 #include <stdexcept>
+#include <memory>
 
 formatter::Format format_from_string(std::string& s) {
     if (s == "json")
@@ -14,4 +21,123 @@ formatter::Format format_from_string(std::string& s) {
         return formatter::Format::SimpleTable;
     else
         throw std::invalid_argument("invalid format");
-}
\ No newline at end of file
+}
+
+voltronic::SerialBaudRate serial_baud_rate_from_string(std::string& s) {
+    if (s == "auto")
+        return voltronic::SerialDevice::BAUD_RATE_AUTO;
+
+    unsigned long value;
+    try {
+        value = std::stoul(s);
+    } catch (std::out_of_range& e) {
+        throw std::invalid_argument("invalid serial baud rate");
+    }
+
+    auto baudRate = static_cast<voltronic::SerialBaudRate>(value);
+    if (value != baudRate || !voltronic::is_serial_baud_rate_valid(baudRate))
+        throw std::invalid_argument("invalid serial baud rate");
+
+    return baudRate;
+}
+
+
+/**
+ * Serial baud rate detection
+ */
+
+// queries per rate; all of them must pass for the rate to be accepted
+static const int BAUD_RATE_PROBE_ATTEMPTS = 3;
+
+// a PI query and its response, including crc and CR, take about this many
+// bytes on the wire, 10 bits each with start and stop bits
+static const u64 BAUD_RATE_PROBE_BYTES = 20;
+
+// time for the device to respond, on top of the transfer itself
+static const u64 BAUD_RATE_PROBE_MARGIN = 300;
+
+// don't wait for a full device timeout at rates that obviously don't work, but
+// give slow ones enough time: the exchange alone takes ~1.8 s at 110 baud
+static u64 serial_baud_rate_probe_timeout(voltronic::SerialBaudRate baudRate) {
+    return BAUD_RATE_PROBE_BYTES * 10 * 1000 / baudRate + BAUD_RATE_PROBE_MARGIN;
+}
+
+static bool serial_baud_rate_probe(voltronic::SerialDevice& device,
+                                   voltronic::SerialBaudRate baudRate,
+                                   int attempts) {
+    // the client is given a non-owning pointer, device is owned by the caller
+    p18::Client client;
+    client.setDevice(std::shared_ptr<voltronic::Device>(&device, [](voltronic::Device*) {}));
+
+    device.setBaudRate(baudRate);
+    device.setTimeout(serial_baud_rate_probe_timeout(baudRate));
+
+    std::vector<std::string> arguments;
+    for (int i = 0; i < attempts; i++) {
+        try {
+            client.execute(p18::CommandType::GetProtocolID, arguments);
+        }
+        catch (voltronic::TimeoutError& e) {
+            return false;
+        }
+        catch (voltronic::InvalidDataError& e) {
+            return false;
+        }
+        catch (p18::InvalidResponseError& e) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+voltronic::SerialBaudRate serial_baud_rate_detect(voltronic::SerialDevice& device,
+                                                  const std::string& stateDir,
+                                                  bool verbose) {
+    std::string stateName = state_file_name("serial-baud-rate-", device.getName());
+    std::string saved;
+
+    // serial_baud_rate_probe() sets its own
+    u64 timeout = device.getTimeout();
+
+    voltronic::SerialBaudRate result = voltronic::SerialDevice::BAUD_RATE_AUTO;
+
+    // the rate found last time is most likely still good, check it first
+    if (state_load(stateDir, stateName, saved)) {
+        try {
+            auto baudRate = serial_baud_rate_from_string(saved);
+            if (baudRate != voltronic::SerialDevice::BAUD_RATE_AUTO && serial_baud_rate_probe(device, baudRate, 1))
+                result = baudRate;
+            else if (verbose)
+                myerr << "saved baud rate " << baudRate << " doesn't work anymore";
+        }
+        // std::invalid_argument or std::out_of_range, the file may be corrupt
+        catch (std::logic_error& e) {
+            myerr << "ignoring invalid saved baud rate: " << saved;
+        }
+    }
+
+    // go from the fastest to the slowest, the first one that works wins
+    if (result == voltronic::SerialDevice::BAUD_RATE_AUTO) {
+        for (auto it = voltronic::serial_baud_rates.rbegin(); it != voltronic::serial_baud_rates.rend(); ++it) {
+            if (verbose)
+                myerr << "probing " << *it << " baud";
+
+            if (serial_baud_rate_probe(device, *it, BAUD_RATE_PROBE_ATTEMPTS)) {
+                result = *it;
+                state_save(stateDir, stateName, std::to_string(result));
+                break;
+            }
+        }
+    }
+
+    device.setTimeout(timeout);
+
+    if (result == voltronic::SerialDevice::BAUD_RATE_AUTO)
+        throw voltronic::DeviceError("failed to detect baud rate");
+
+    if (verbose)
+        myerr << "using " << result << " baud";
+
+    return result;
+}
@@ -3,12 +3,20 @@
 #ifndef INVERTER_TOOLS_COMMON_H
 #define INVERTER_TOOLS_COMMON_H
 
+#include <string>
+
 #include "formatter/formatter.h"
+#include "voltronic/device.h"
+
+// where inverterd listens by default
+static const char* const DEFAULT_HOST = "127.0.0.1";
+static const int DEFAULT_PORT = 8305;
 
 enum class DeviceType {
     USB,
     Serial,
-    Pseudo
+    Pseudo,
+    Simulated
 };
 
 // long opts
@@ -32,8 +40,39 @@ enum {
     LO_SERIAL_PARITY,
     LO_HOST,
     LO_PORT,
+    LO_STATE_DIR,
+    LO_STATS_INTERVAL,
+    LO_QUEUE_DEPTH,
+    LO_QUEUE_TIMEOUT,
+    LO_STALE_WHILE_REVALIDATE,
+    LO_MAX_STALE,
+    LO_FACTS_CACHE_TIMEOUT,
+    LO_MAX_CONNECTIONS,
+    LO_LISTEN_BACKLOG,
+    LO_RATE_LIMIT,
+    LO_IP_RATE_LIMIT,
+    LO_UNIX_SOCKET,
+    LO_CONTROL_UIDS,
+    LO_SHM_NAME,
+    LO_SHM_INTERVAL,
+    LO_EVENTS_INTERVAL,
+    LO_BATCH,
+    LO_SERVER,
+    LO_INTERVAL,
+    LO_SYSLOG,
+    LO_ACCESS_LOG,
+    LO_SIM_LATENCY,
+    LO_SIM_JITTER,
+    LO_SIM_CRC_ERROR_RATE,
+    LO_SIM_TRUNCATE_RATE,
+    LO_SIM_TIMEOUT_RATE,
 };
 
 formatter::Format format_from_string(std::string& s);
 
+voltronic::SerialBaudRate serial_baud_rate_from_string(std::string& s);
+voltronic::SerialBaudRate serial_baud_rate_detect(voltronic::SerialDevice& device,
+                                                  const std::string& stateDir,
+                                                  bool verbose);
+
 #endif //INVERTER_TOOLS_COMMON_H
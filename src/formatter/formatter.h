@@ -9,9 +9,11 @@
 #include <sstream>
 #include <ios>
 #include <iomanip>
+#include <optional>
 #include <nlohmann/json.hpp>
 
 #include "src/util.h"
+#include "src/numeric_types.h"
 
 namespace formatter {
 
@@ -88,10 +90,22 @@ class Formattable {
 protected:
     Format format_;
 
+    // age of the data in ms, set when it's older than the client would expect
+    std::optional<u64> age_;
+
+    void writeAge(ordered_json& j) const {
+        if (age_)
+            j["age"] = *age_;
+    }
+
 public:
     explicit Formattable(Format format) : format_(format) {}
     virtual ~Formattable() = default;
 
+    void setAge(u64 age) {
+        age_ = age;
+    }
+
     virtual std::ostream& writeJSON(std::ostream& os) const = 0;
     virtual std::ostream& writeSimpleJSON(std::ostream& os) const = 0;
     virtual std::ostream& writeTable(std::ostream& os) const = 0;
@@ -100,10 +114,16 @@ public:
     friend std::ostream& operator<<(std::ostream& os, Formattable const& ref) {
         switch (ref.format_) {
             case Format::Table:
-                return ref.writeTable(os);
+                ref.writeTable(os);
+                if (ref.age_)
+                    os << std::endl << "(stale, " << *ref.age_ << " ms old)";
+                return os;
 
             case Format::SimpleTable:
-                return ref.writeSimpleTable(os);
+                ref.writeSimpleTable(os);
+                if (ref.age_)
+                    os << std::endl << "age " << *ref.age_;
+                return os;
 
             case Format::JSON:
                 return ref.writeJSON(os);
@@ -131,6 +151,10 @@ public:
         v_.push_back(item);
     }
 
+    const std::vector<TableItem<T>>& items() const {
+        return v_;
+    }
+
     std::ostream& writeSimpleTable(std::ostream& os) const override {
         for (const auto& item: v_) {
             os << item.key << " ";
@@ -191,6 +215,7 @@ public:
                 j["data"][item.key] = item.value.toJSON();
             }
         }
+        writeAge(j);
         return os << j.dump();
     }
 
@@ -202,6 +227,74 @@ public:
         for (const auto &item: v_) {
             j["data"][item.key] = item.value.toSimpleJSON();
         }
+        writeAge(j);
+        return os << j.dump();
+    }
+};
+
+// changed items of a Table, keyed by their position in it
+template <typename T>
+class DeltaTable : public Formattable {
+protected:
+    std::vector<std::pair<size_t, TableItem<T>>> v_;
+
+public:
+    explicit DeltaTable(Format format, std::vector<std::pair<size_t, TableItem<T>>> v)
+        : Formattable(format), v_(v) {}
+
+    std::ostream& writeSimpleTable(std::ostream& os) const override {
+        for (const auto& item: v_) {
+            os << item.first << " ";
+
+            std::string value = to_str(item.second.value);
+            bool space = string_has(value, ' ');
+            if (space)
+                os << "\"";
+            os << value;
+            if (space)
+                os << "\"";
+
+            if (&item != &v_.back())
+                os << std::endl;
+        }
+        return os;
+    }
+
+    std::ostream& writeTable(std::ostream& os) const override {
+        for (const auto& item: v_) {
+            os << item.second.title << ": " << item.second.value;
+
+            if (item.second.unit != Unit::None)
+                os << " " << item.second.unit;
+
+            if (&item != &v_.back())
+                os << std::endl;
+        }
+        return os;
+    }
+
+    // units are left out, they're in the full table
+    std::ostream& writeJSON(std::ostream& os) const override {
+        ordered_json j = {
+            {"result", "ok"},
+            {"delta", true},
+            {"data", json::object()}
+        };
+        for (const auto &item: v_)
+            j["data"][std::to_string(item.first)] = item.second.value.toJSON();
+        writeAge(j);
+        return os << j.dump();
+    }
+
+    std::ostream& writeSimpleJSON(std::ostream& os) const override {
+        ordered_json j = {
+            {"result", "ok"},
+            {"delta", true},
+            {"data", json::object()}
+        };
+        for (const auto &item: v_)
+            j["data"][std::to_string(item.first)] = item.second.value.toSimpleJSON();
+        writeAge(j);
         return os << j.dump();
     }
 };
@@ -237,6 +330,7 @@ public:
         for (const auto &item: v_)
             data.push_back(item.value.toJSON());
         j["data"] = data;
+        writeAge(j);
 
         return os << j.dump();
     }
@@ -250,6 +344,7 @@ public:
         for (const auto &item: v_)
             data.push_back(item.value.toSimpleJSON());
         j["data"] = data;
+        writeAge(j);
 
         return os << j.dump();
     }
@@ -281,7 +376,10 @@ public:
         };
         if (!message_.empty())
             j["message"] = message_;
-        return os << j.dump();
+        writeAge(j);
+        // error messages may quote whatever the client has sent, which isn't
+        // necessarily valid utf-8
+        return os << j.dump(-1, ' ', false, ordered_json::error_handler_t::replace);
     }
 
     std::ostream& writeSimpleJSON(std::ostream& os) const override {
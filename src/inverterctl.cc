@@ -8,7 +8,12 @@
 #include <array>
 #include <vector>
 #include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <chrono>
 #include <getopt.h>
+#include <unistd.h>
 
 #include "logging.h"
 #include "util.h"
@@ -21,9 +26,12 @@
 #include "formatter/formatter.h"
 #include "voltronic/device.h"
 #include "voltronic/exceptions.h"
+#include "voltronic/time.h"
+#include "server/remote_client.h"
 #include "hexdump/hexdump.h"
 
 const size_t MAX_RAW_COMMAND_LENGTH = 128;
+const u64 WATCH_INTERVAL = 1000;
 
 template <typename T, std::size_t N>
 std::ostream& operator<<(std::ostream& os, const std::array<T, N>& P) {
@@ -36,14 +44,18 @@ std::ostream& operator<<(std::ostream& os, const std::array<T, N>& P) {
 }
 
 static void short_usage(const char* progname) {
-    std::cout << "Usage: " << progname << " OPTIONS [COMMAND]\n" <<
+    std::cout << "Usage: " << progname << " OPTIONS [watch] [COMMAND]\n" <<
         "\n"
         "Options:\n"
         "    -h:                  Show this help\n"
         "    --help:              Show full help (with all commands)\n"
         "    --raw <DATA>:        Execute arbitrary command and print response\n"
-        "    --device <DEVICE>:   'usb' (default), 'serial' or 'pseudo'\n"
+        "    --batch <FILE>:      Execute commands from FILE ('-' for stdin), one per line\n"
+        "    --device <DEVICE>:   'usb' (default), 'serial', 'pseudo' or 'sim'\n"
+        "    --server <ADDRESS>:  Send commands to inverterd at HOST[:PORT] or unix\n"
+        "                         socket PATH instead of the device\n"
         "    --timeout <TIMEOUT>: Timeout in ms (default: " << voltronic::Device::TIMEOUT << ")\n"
+        "    --interval <MS>:     Refresh interval for watch (default: " << WATCH_INTERVAL << ")\n"
         "    --verbose:           Be verbose\n"
         "    --format <FORMAT>:   'table' (default), 'simple-table', 'json' or\n"
         "                         'simple-json'\n"
@@ -54,25 +66,43 @@ static void short_usage(const char* progname) {
 
 static void usage(const char* progname) {
     std::ios_base::fmtflags f(std::cout.flags());
-    std::cout << "Usage: " << progname << " OPTIONS [COMMAND]\n" <<
+    std::cout << "Usage: " << progname << " OPTIONS [watch] [COMMAND]\n" <<
            "\n"
            "Options:\n"
            "    -h:                  Show short help\n"
            "    --help:              Show this help\n"
            "    --raw <DATA>:        Execute arbitrary command and print response\n"
            "                         (example: ^P005PI)\n"
+           "    --batch <FILE>:      Execute commands from FILE, or from stdin if FILE\n"
+           "                         is '-', one command with its arguments per line,\n"
+           "                         over a single device connection. Empty lines and\n"
+           "                         lines starting with '#' are skipped. All commands\n"
+           "                         are validated before anything is executed.\n"
+           "                         Results are printed in order: one per line for\n"
+           "                         JSON formats, separated by empty lines otherwise\n"
            "    --device <DEVICE>:   Device type to use. See below for list of supported\n"
            "                         devices\n"
+           "    --server <ADDRESS>:  Don't open the device, send commands to a running\n"
+           "                         inverterd instead, so that they're answered from\n"
+           "                         its cache when possible. ADDRESS is HOST[:PORT]\n"
+           "                         ([HOST]:PORT for IPv6, default port is " << DEFAULT_PORT << ")\n"
+           "                         or a path to unix socket. --timeout then applies\n"
+           "                         to the connection (default: " << server::RemoteClient::TIMEOUT << ")\n"
            "    --timeout <TIMEOUT>: Device read/write timeout, in milliseconds\n"
            "                         (default: " << voltronic::Device::TIMEOUT << ")\n"
+           "    --interval <MS>:     How often to execute the command in watch mode,\n"
+           "                         in milliseconds (default: " << WATCH_INTERVAL << ")\n"
            "    --verbose:           Print debug information (including hex dumps of\n"
            "                         device traffic)\n"
            "    --format <FORMAT>:   Output format for command responses\n"
+           "    --state-dir <DIR>:   Directory to keep state between runs in\n"
+           "                         (e.g. detected serial baud rate)\n"
            "\n"
            "Device types:\n"
            "    usb     USB device\n"
            "    serial  Serial device\n"
            "    pseudo  Pseudo device (only useful for development/debugging purposes)\n"
+           "    sim     Simulated inverter, answers every command with changing values\n"
            "\n";
     std::cout << std::hex << std::setfill('0') <<
            "USB device options:\n"
@@ -86,11 +116,20 @@ static void usage(const char* progname) {
     std::cout <<
            "Serial device options:\n"
            "    --serial-name <NAME>: Path to serial device (default: " << voltronic::SerialDevice::DEVICE_NAME << ")\n"
-           "    --serial-baud-rate 110|300|1200|2400|4800|9600|19200|38400|57600|115200\n"
+           "    --serial-baud-rate auto|110|300|1200|2400|4800|9600|19200|38400|57600|115200\n"
+           "                          'auto' picks the fastest rate the device answers at\n"
            "    --serial-data-bits 5|6|7|8\n"
            "    --serial-stop-bits 1|1.5|2\n"
            "    --serial-parity none|odd|even|mark|space\n"
            "\n"
+           "Watch mode:\n"
+           "    watch <command> [...arguments]\n"
+           "        Keep the device open and execute the command every --interval ms,\n"
+           "        until interrupted. Tables are refreshed in place (only changed\n"
+           "        lines are redrawn) when writing to a terminal; JSON formats\n"
+           "        print one response per line, with a 'time' field added (ms since\n"
+           "        epoch).\n"
+           "\n"
            "Commands:\n"
            "    get-protocol-id\n"
            "    get-date-time\n"
@@ -213,7 +252,10 @@ static void usage(const char* progname) {
            "    table         Human-readable table\n"
            "    simple-table  Conveniently-parsable table\n"
            "    json          JSON object or array\n"
-           "    simple-json   no units, enumerations represented as numbers\n";
+           "    simple-json   no units, enumerations represented as numbers\n"
+           "\n"
+           "Exit status:\n"
+           "    0 on success, 1 on any error.\n";
 
     exit(1);
 }
@@ -240,8 +282,156 @@ enum class Action {
     FullHelp,
     Raw,
     Command,
+    Batch,
+};
+
+struct BatchCommand {
+    std::string line;
+    std::vector<std::string> input; /* command and arguments as given */
+    p18::CommandType commandType;
+    std::vector<std::string> arguments;
 };
 
+static std::vector<BatchCommand> read_batch(const std::string& file) {
+    std::ifstream f;
+    std::istream* is = &std::cin;
+    if (file != "-") {
+        f.open(file);
+        if (!f.is_open())
+            throw std::invalid_argument("failed to open " + file);
+        is = &f;
+    }
+
+    std::vector<BatchCommand> commands;
+    std::string line;
+    unsigned lineNumber = 0;
+
+    while (std::getline(*is, line)) {
+        lineNumber++;
+
+        std::vector<std::string> tokens;
+        std::istringstream buf(line);
+        for (std::string token; buf >> token;)
+            tokens.push_back(token);
+
+        if (tokens.empty() || tokens[0][0] == '#')
+            continue;
+
+        // validate_input() takes arguments from argv, starting at optind
+        std::vector<char*> argv;
+        for (auto& token: tokens)
+            argv.push_back(token.data());
+        argv.push_back(nullptr);
+        optind = 1;
+
+        try {
+            BatchCommand command;
+            command.line = line;
+            command.input = tokens;
+
+            p18::CommandInput input{static_cast<int>(tokens.size()), argv.data()};
+            command.commandType = p18::validate_input(tokens[0], command.arguments, (void*)&input);
+
+            if (optind < static_cast<int>(tokens.size()))
+                throw std::invalid_argument("extra parameter found");
+
+            commands.push_back(std::move(command));
+        }
+        catch (std::invalid_argument& e) {
+            throw std::invalid_argument("line " + std::to_string(lineNumber) + ": " + e.what());
+        }
+    }
+
+    return commands;
+}
+
+static void split_lines(const std::string& s, std::vector<std::string>& lines) {
+    lines.clear();
+    std::istringstream buf(s);
+    for (std::string line; std::getline(buf, line);)
+        lines.push_back(line);
+}
+
+/**
+ * Runs `sample` every `interval` ms and prints its output. Never returns.
+ */
+[[noreturn]] static void watch(const std::function<std::string()>& sample, formatter::Format format, u64 interval) {
+    bool json = format == formatter::Format::JSON || format == formatter::Format::SimpleJSON;
+    bool tty = isatty(STDOUT_FILENO);
+    std::vector<std::string> lines, prevLines;
+
+    while (true) {
+        u64 started = voltronic::timestamp();
+
+        std::string output;
+        try {
+            output = sample();
+        }
+        catch (server::RemoteError& e) {
+            // the connection is gone, nothing to retry with
+            throw;
+        }
+        catch (std::exception& e) {
+            std::ostringstream buf;
+            buf << *(p18::response_type::ErrorResponse(e.what()).format(format));
+            output = buf.str();
+        }
+
+        if (json) {
+            auto now = std::chrono::system_clock::now().time_since_epoch();
+            try {
+                auto j = formatter::ordered_json::parse(output);
+                j["time"] = std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+                std::cout << j.dump() << std::endl;
+            }
+            catch (formatter::json::exception& e) {
+                std::cout << output << std::endl;
+            }
+        } else if (!tty) {
+            if (!prevLines.empty())
+                std::cout << std::endl;
+            std::cout << output << std::endl;
+            prevLines.assign(1, output);
+        } else {
+            split_lines(output, lines);
+
+            if (lines.size() != prevLines.size()) {
+                // different shape, redraw everything
+                if (!prevLines.empty())
+                    std::cout << "\x1b[" << prevLines.size() << "A\r\x1b[J";
+                for (const auto& line: lines)
+                    std::cout << line << "\n";
+            } else {
+                for (size_t i = 0; i < lines.size(); i++) {
+                    if (lines[i] == prevLines[i])
+                        continue;
+                    size_t up = lines.size() - i;
+                    std::cout << "\x1b[" << up << "A\r" << lines[i] << "\x1b[K\x1b[" << up << "B\r";
+                }
+            }
+            std::cout << std::flush;
+            std::swap(lines, prevLines);
+        }
+
+        u64 elapsed = voltronic::timestamp() - started;
+        if (elapsed < interval)
+            usleep((interval - elapsed) * 1000);
+    }
+}
+
+static bool output_remote_response(formatter::Format format, const server::RemoteResponse& resp) {
+    if (resp.ok) {
+        std::cout << resp.body << std::endl;
+        return true;
+    }
+
+    if (format == formatter::Format::JSON)
+        std::cout << resp.body << std::endl;
+    else
+        std::cerr << resp.body << std::endl;
+    return false;
+}
+
 int main(int argc, char *argv[]) {
     if (argv[1] == nullptr)
         short_usage(argv[0]);
@@ -250,18 +440,29 @@ int main(int argc, char *argv[]) {
     Action action = Action::Command;
     u64 timeout = voltronic::Device::TIMEOUT;
     bool verbose = false;
+    bool timeoutChanged = false;
+    bool watchMode = false;
+    u64 watchInterval = WATCH_INTERVAL;
+    std::string stateDir;
     p18::CommandType commandType;
     std::vector<std::string> arguments;
+    std::vector<std::string> input;
 
     // format params
     bool formatChanged = false;
     formatter::Format format = formatter::Format::Table;
+    std::string formatName = "table";
 
     // raw command param
     std::string raw;
 
+    // batch mode
+    std::string batchFile;
+    std::vector<BatchCommand> batch;
+
     // device params
     DeviceType deviceType = DeviceType::USB;
+    std::string serverAddress;
 
     u16 usbVendorId = voltronic::USBDevice::VENDOR_ID;
     u16 usbDeviceId = voltronic::USBDevice::PRODUCT_ID;
@@ -279,9 +480,12 @@ int main(int argc, char *argv[]) {
             {"help",    no_argument,       nullptr, LO_HELP},
             {"verbose", no_argument,       nullptr, LO_VERBOSE},
             {"raw",                 required_argument, nullptr, LO_RAW},
+            {"batch",               required_argument, nullptr, LO_BATCH},
             {"timeout",             required_argument, nullptr, LO_TIMEOUT},
             {"format",              required_argument, nullptr, LO_FORMAT},
             {"device",              required_argument, nullptr, LO_DEVICE},
+            {"server",              required_argument, nullptr, LO_SERVER},
+            {"interval",            required_argument, nullptr, LO_INTERVAL},
             {"usb-vendor-id",       required_argument, nullptr, LO_USB_VENDOR_ID},
             {"usb-device-id",       required_argument, nullptr, LO_USB_DEVICE_ID},
             {"usb-path",            required_argument, nullptr, LO_USB_PATH},
@@ -290,6 +494,7 @@ int main(int argc, char *argv[]) {
             {"serial-data-bits",    required_argument, nullptr, LO_SERIAL_DATA_BITS},
             {"serial-stop-bits",    required_argument, nullptr, LO_SERIAL_STOP_BITS},
             {"serial-parity",       required_argument, nullptr, LO_SERIAL_PARITY},
+            {"state-dir",           required_argument, nullptr, LO_STATE_DIR},
             {nullptr, 0, nullptr, 0}
         };
 
@@ -316,6 +521,7 @@ int main(int argc, char *argv[]) {
             switch (opt) {
                 case LO_FORMAT:
                     format = format_from_string(arg);
+                    formatName = arg;
                     formatChanged = true;
                     break;
 
@@ -326,6 +532,8 @@ int main(int argc, char *argv[]) {
                         deviceType = DeviceType::Serial;
                     else if (arg == "pseudo")
                         deviceType = DeviceType::Pseudo;
+                    else if (arg == "sim")
+                        deviceType = DeviceType::Simulated;
                     else
                         throw std::invalid_argument("invalid device");
 
@@ -338,8 +546,22 @@ int main(int argc, char *argv[]) {
                     action = Action::Raw;
                     break;
 
+                case LO_BATCH:
+                    batchFile = arg;
+                    action = Action::Batch;
+                    break;
+
                 case LO_TIMEOUT:
                     timeout = std::stoull(arg);
+                    timeoutChanged = true;
+                    break;
+
+                case LO_SERVER:
+                    serverAddress = arg;
+                    break;
+
+                case LO_INTERVAL:
+                    watchInterval = std::stoull(arg);
                     break;
 
                 case LO_USB_VENDOR_ID:
@@ -371,9 +593,7 @@ int main(int argc, char *argv[]) {
                     break;
 
                 case LO_SERIAL_BAUD_RATE:
-                    serialBaudRate = static_cast<voltronic::SerialBaudRate>(std::stoul(arg));
-                    if (!voltronic::is_serial_baud_rate_valid(serialBaudRate))
-                        throw std::invalid_argument("invalid serial baud rate");
+                    serialBaudRate = serial_baud_rate_from_string(arg);
                     break;
 
                 case LO_SERIAL_DATA_BITS:
@@ -393,6 +613,10 @@ int main(int argc, char *argv[]) {
                         throw std::invalid_argument("invalid serial stop bits");
                     break;
 
+                case LO_STATE_DIR:
+                    stateDir = arg;
+                    break;
+
                 case LO_SERIAL_PARITY:
                     if (arg == "none")
                         serialParity = voltronic::SerialParity::None;
@@ -426,16 +650,38 @@ int main(int argc, char *argv[]) {
                 if (argc <= optind)
                     throw std::invalid_argument("missing command");
 
+                if (std::string(argv[optind]) == "watch") {
+                    watchMode = true;
+                    if (argc <= ++optind)
+                        throw std::invalid_argument("missing command");
+                }
+
+                int commandIndex = optind;
                 std::string command = argv[optind++];
 
-                p18::CommandInput input{argc, argv};
-                commandType = p18::validate_input(command, arguments, (void*)&input);
+                p18::CommandInput commandInput{argc, argv};
+                commandType = p18::validate_input(command, arguments, (void*)&commandInput);
+
+                input.assign(argv + commandIndex, argv + optind);
                 break;
             }
 
             case Action::Raw:
                 if (formatChanged)
                     throw std::invalid_argument("--format is not allowed with --raw");
+                if (!serverAddress.empty())
+                    throw std::invalid_argument("--raw is not allowed with --server");
+                break;
+
+            case Action::Batch:
+                if (optind < argc)
+                    throw std::invalid_argument("commands are not allowed with --batch");
+                else {
+                    // read_batch() moves optind around
+                    int savedOptind = optind;
+                    batch = read_batch(batchFile);
+                    optind = savedOptind;
+                }
                 break;
         }
 
@@ -446,6 +692,38 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (!serverAddress.empty()) {
+        bool success = true;
+        try {
+            server::RemoteClient remote;
+            remote.connect(serverAddress, timeoutChanged ? timeout : server::RemoteClient::TIMEOUT);
+            remote.setOption("v 1");
+            remote.setOption("format " + formatName);
+
+            if (action == Action::Batch) {
+                bool json = format == formatter::Format::JSON || format == formatter::Format::SimpleJSON;
+                for (auto& command: batch) {
+                    if (!json && &command != &batch.front())
+                        std::cout << std::endl;
+                    if (!output_remote_response(format, remote.execute(command.input)))
+                        success = false;
+                }
+            } else if (watchMode) {
+                watch([&remote, &input]() {
+                    // errors come already formatted
+                    return remote.execute(input).body;
+                }, format, watchInterval);
+            } else {
+                success = output_remote_response(format, remote.execute(input));
+            }
+        }
+        catch (server::RemoteError& e) {
+            output_formatted_error(format, e, "server error");
+            return 1;
+        }
+        return success ? 0 : 1;
+    }
+
     bool success = false;
     try {
         std::shared_ptr<voltronic::Device> dev;
@@ -463,6 +741,10 @@ int main(int argc, char *argv[]) {
                 dev = std::shared_ptr<voltronic::Device>(new voltronic::PseudoDevice);
                 break;
 
+            case DeviceType::Simulated:
+                dev = std::shared_ptr<voltronic::Device>(new voltronic::SimulatedDevice);
+                break;
+
             case DeviceType::Serial:
                 dev = std::shared_ptr<voltronic::Device>(new voltronic::SerialDevice(serialDeviceName,
                                                                                      serialBaudRate,
@@ -475,6 +757,11 @@ int main(int argc, char *argv[]) {
         dev->setVerbose(verbose);
         dev->setTimeout(timeout);
 
+        if (deviceType == DeviceType::Serial && serialBaudRate == voltronic::SerialDevice::BAUD_RATE_AUTO) {
+            auto serialDevice = std::static_pointer_cast<voltronic::SerialDevice>(dev);
+            serial_baud_rate_detect(*serialDevice, stateDir, verbose);
+        }
+
         p18::Client client;
         client.setDevice(dev);
 
@@ -483,6 +770,46 @@ int main(int argc, char *argv[]) {
             if (verbose)
                 std::cerr << hexdump(result.first.get(), result.second);
             std::cout << std::string(result.first.get(), result.second) << std::endl;
+        } else if (action == Action::Batch) {
+            bool json = format == formatter::Format::JSON || format == formatter::Format::SimpleJSON;
+            bool failed = false;
+
+            for (auto& command: batch) {
+                if (!json && &command != &batch.front())
+                    std::cout << std::endl;
+
+                // keep going, so that every line gets its result
+                try {
+                    auto response = client.execute(command.commandType, command.arguments);
+                    std::cout << *(response->format(format).get()) << std::endl;
+                    continue;
+                }
+                catch (voltronic::DeviceError& e) {
+                    output_formatted_error(format, e, command.line + ": device error");
+                }
+                catch (voltronic::TimeoutError& e) {
+                    output_formatted_error(format, e, command.line + ": timeout");
+                }
+                catch (voltronic::InvalidDataError& e) {
+                    output_formatted_error(format, e, command.line + ": data is invalid");
+                }
+                catch (p18::InvalidResponseError& e) {
+                    output_formatted_error(format, e, command.line + ": response is invalid");
+                }
+
+                failed = true;
+                if (format == formatter::Format::JSON)
+                    std::cout << std::endl;
+            }
+
+            return failed ? 1 : 0;
+        } else if (watchMode) {
+            watch([&client, &commandType, &arguments, &format]() {
+                auto response = client.execute(commandType, arguments);
+                std::ostringstream buf;
+                buf << *(response->format(format).get());
+                return buf.str();
+            }, format, watchInterval);
         } else {
             auto response = client.execute(commandType, arguments);
             std::cout << *(response->format(format).get()) << std::endl;
@@ -503,5 +830,5 @@ int main(int argc, char *argv[]) {
         output_formatted_error(format, e, "response is invalid");
     }
 
-    return success ? 1 : 0;
+    return success ? 0 : 1;
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <vector>
 #include <iomanip>
 #include <ios>
+#include <sstream>
 #include <getopt.h>
 
 #include "numeric_types.h"
@@ -17,24 +18,74 @@
 #include "server/server.h"
 #include "server/signal.h"
 
-static const char* DEFAULT_HOST = "127.0.0.1";
-static int DEFAULT_PORT = 8305;
+static double rate_from_string(const std::string& s) {
+    double rate = std::stod(s);
+    if (rate < 0 || rate > 1)
+        throw std::invalid_argument("rate must be between 0 and 1");
+    return rate;
+}
 
 static void usage(const char* progname) {
     std::cout << "Usage: " << progname << " OPTIONS [COMMAND]\n" <<
               "\n"
               "Options:\n"
               "    -h, --help:          Show this help\n"
-              "    --host <HOST>:       Server host (default: " << DEFAULT_HOST << ")\n"
-              "    --port <PORT>        Server port (default: " << DEFAULT_PORT << ")\n"
-              "    --device <DEVICE>:   'usb' (default), 'serial' or 'pseudo'\n"
+              "    --host <HOST>:       Server host, IPv4 or IPv6; may be given multiple\n"
+              "                         times (default: " << DEFAULT_HOST << ")\n"
+              "    --port <PORT>        Server port, 0 to disable TCP (default: " << DEFAULT_PORT << ")\n"
+              "    --unix-socket <PATH> Also listen on a unix socket\n"
+              "    --control-uids <UID[,UID...]>\n"
+              "                         Only allow set-* commands from unix socket clients\n"
+              "                         running as one of these users\n"
+              "    --device <DEVICE>:   'usb' (default), 'serial', 'pseudo' or 'sim'\n"
               "    --timeout <TIMEOUT>: Device timeout in ms (default: " << voltronic::Device::TIMEOUT << ")\n"
               "    --cache-timeout <TIMEOUT>\n"
               "                         Default: " << server::Server::CACHE_TIMEOUT << "\n"
+              "    --facts-cache-timeout <TIMEOUT>\n"
+              "                         Cache validity time of responses that never change\n"
+              "                         (serial number, rated information, etc.), in ms\n"
+              "                         (default: " << server::Server::FACTS_CACHE_TIMEOUT << ")\n"
+              "    --stale-while-revalidate\n"
+              "                         Answer with expired cached data right away and\n"
+              "                         refresh it in background\n"
+              "    --max-stale <TIME>:  How long, in ms, data may be served past its expiry\n"
+              "                         with --stale-while-revalidate, 0 for no limit\n"
+              "                         (default: " << server::Server::MAX_STALE << ")\n"
               "    --delay <DELAY>:     Delay between commands in ms (default: " << server::Server::DELAY << ")\n"
               "                         Cache validity time, in ms (default: " << server::Server::CACHE_TIMEOUT << ")\n"
               "    --device-error-limit <LIMIT>\n"
               "                         Default: " << server::Server::DEVICE_ERROR_LIMIT << "\n"
+              "    --max-connections <N>\n"
+              "                         Max number of clients, 0 for no limit (default: " << server::Server::MAX_CONNECTIONS << ")\n"
+              "    --listen-backlog <N> Default: " << server::Server::LISTEN_BACKLOG << "\n"
+              "    --rate-limit <N>:    Max number of device requests per second per\n"
+              "                         connection, cache hits don't count (default: off)\n"
+              "    --ip-rate-limit <N>: Same, but per client address (default: off);\n"
+              "                         unix socket clients are limited per uid\n"
+              "    --queue-depth <DEPTH>\n"
+              "                         Max number of requests waiting for device,\n"
+              "                         0 for no limit (default: " << server::DeviceQueue::MAX_DEPTH << ")\n"
+              "    --queue-timeout <TIMEOUT>\n"
+              "                         Default request deadline in ms, 0 for none; requests\n"
+              "                         that can't make it are answered from cache or\n"
+              "                         rejected (default: " << server::Server::QUEUE_TIMEOUT << ")\n"
+              "    --shm-name <NAME>:   Publish latest status, errors and flags to the POSIX\n"
+              "                         shared memory segment NAME (e.g. /inverterd), see\n"
+              "                         src/server/shm.h for the layout\n"
+              "    --shm-interval <MS>: Poll them for the shared memory every MS ms,\n"
+              "                         0 to only publish what clients ask for (default: 0)\n"
+              "    --events-interval <MS>: Poll errors, mode and flags every MS ms to detect\n"
+              "                         changes for subscribers, 0 to only detect them in\n"
+              "                         what clients ask for (default: 0)\n"
+              "    --state-dir <DIR>:   Directory to keep state between restarts in\n"
+              "                         (e.g. detected serial baud rate, serial number\n"
+              "                         and rated information of the device)\n"
+              "    --access-log <FILE>: Append a JSON line per handled request to FILE, with\n"
+              "                         client, command, cache status, queue wait, device and\n"
+              "                         format times (us), bytes sent and the result\n"
+              "    --stats-interval <SEC>\n"
+              "                         Log latency stats every SEC seconds (default: off)\n"
+              "    --syslog:            Log to syslog instead of stdout and stderr\n"
               "    --verbose:           Be verbose\n"
               "\n";
 
@@ -51,10 +102,21 @@ static void usage(const char* progname) {
     std::cout << "\n"
               "Serial device options:\n"
               "    --serial-name <NAME>: Path to serial device (default: " << voltronic::SerialDevice::DEVICE_NAME << ")\n"
-              "    --serial-baud-rate 110|300|1200|2400|4800|9600|19200|38400|57600|115200\n"
+              "    --serial-baud-rate auto|110|300|1200|2400|4800|9600|19200|38400|57600|115200\n"
+              "                          'auto' picks the fastest rate the device answers at\n"
               "    --serial-data-bits 5|6|7|8\n"
               "    --serial-stop-bits 1|1.5|2\n"
-              "    --serial-parity none|odd|even|mark|space\n";
+              "    --serial-parity none|odd|even|mark|space\n"
+              "\n"
+              "Simulated device options:\n"
+              "    --sim-latency <MS>:   Delay before each response (default: 0)\n"
+              "    --sim-jitter <MS>:    Vary the delay by up to MS either way (default: 0)\n"
+              "    --sim-crc-error-rate <P>\n"
+              "                          Share of responses with a flipped bit, 0 to 1\n"
+              "    --sim-truncate-rate <P>\n"
+              "                          Share of responses that are cut short, 0 to 1\n"
+              "    --sim-timeout-rate <P>\n"
+              "                          Share of requests left unanswered, 0 to 1\n";
     exit(1);
 }
 
@@ -63,13 +125,31 @@ int main(int argc, char *argv[]) {
     // common params
     u64 timeout = voltronic::Device::TIMEOUT;
     u64 cacheTimeout = server::Server::CACHE_TIMEOUT;
+    u64 factsCacheTimeout = server::Server::FACTS_CACHE_TIMEOUT;
     u64 delay = server::Server::DELAY;
     u32 deviceErrorLimit = server::Server::DEVICE_ERROR_LIMIT;
     bool verbose = false;
+    bool useSyslog = false;
+    bool staleWhileRevalidate = false;
+    u64 maxStale = server::Server::MAX_STALE;
+    std::string stateDir;
+    u64 statsInterval = server::Server::STATS_INTERVAL;
+    size_t queueDepth = server::DeviceQueue::MAX_DEPTH;
+    size_t maxConnections = server::Server::MAX_CONNECTIONS;
+    int listenBacklog = server::Server::LISTEN_BACKLOG;
+    double rateLimit = 0;
+    double ipRateLimit = 0;
+    u64 queueTimeout = server::Server::QUEUE_TIMEOUT;
 
     // server params
-    std::string host(DEFAULT_HOST);
+    std::vector<std::string> hosts;
     int port = DEFAULT_PORT;
+    std::string unixSocket;
+    std::string shmName;
+    std::string accessLog;
+    u64 shmInterval = 0;
+    u64 eventsInterval = 0;
+    std::vector<uid_t> controlUids;
 
     // device params
     DeviceType deviceType = DeviceType::USB;
@@ -84,13 +164,17 @@ int main(int argc, char *argv[]) {
     voltronic::SerialStopBits serialStopBits = voltronic::SerialDevice::STOP_BITS;
     voltronic::SerialParity serialParity = voltronic::SerialDevice::PARITY;
 
+    voltronic::SimulatorFaults simFaults;
+
     try {
         int opt;
         struct option long_options[] = {
             {"help",    no_argument,       nullptr,            'h'},
             {"verbose", no_argument,       nullptr,            LO_VERBOSE},
+            {"syslog",  no_argument,       nullptr,            LO_SYSLOG},
             {"timeout",            required_argument, nullptr, LO_TIMEOUT},
             {"cache-timeout",      required_argument, nullptr, LO_CACHE_TIMEOUT},
+            {"facts-cache-timeout", required_argument, nullptr, LO_FACTS_CACHE_TIMEOUT},
             {"delay",              required_argument, nullptr, LO_DELAY},
             {"device",             required_argument, nullptr, LO_DEVICE},
             {"device-error-limit", required_argument, nullptr, LO_DEVICE_ERROR_LIMIT},
@@ -102,8 +186,29 @@ int main(int argc, char *argv[]) {
             {"serial-data-bits",   required_argument, nullptr, LO_SERIAL_DATA_BITS},
             {"serial-stop-bits",   required_argument, nullptr, LO_SERIAL_STOP_BITS},
             {"serial-parity",      required_argument, nullptr, LO_SERIAL_PARITY},
+            {"sim-latency",        required_argument, nullptr, LO_SIM_LATENCY},
+            {"sim-jitter",         required_argument, nullptr, LO_SIM_JITTER},
+            {"sim-crc-error-rate", required_argument, nullptr, LO_SIM_CRC_ERROR_RATE},
+            {"sim-truncate-rate",  required_argument, nullptr, LO_SIM_TRUNCATE_RATE},
+            {"sim-timeout-rate",   required_argument, nullptr, LO_SIM_TIMEOUT_RATE},
             {"host",               required_argument, nullptr, LO_HOST},
             {"port",               required_argument, nullptr, LO_PORT},
+            {"unix-socket",        required_argument, nullptr, LO_UNIX_SOCKET},
+            {"control-uids",       required_argument, nullptr, LO_CONTROL_UIDS},
+            {"shm-name",           required_argument, nullptr, LO_SHM_NAME},
+            {"access-log",         required_argument, nullptr, LO_ACCESS_LOG},
+            {"shm-interval",       required_argument, nullptr, LO_SHM_INTERVAL},
+            {"events-interval",    required_argument, nullptr, LO_EVENTS_INTERVAL},
+            {"state-dir",          required_argument, nullptr, LO_STATE_DIR},
+            {"stats-interval",     required_argument, nullptr, LO_STATS_INTERVAL},
+            {"queue-depth",        required_argument, nullptr, LO_QUEUE_DEPTH},
+            {"max-connections",    required_argument, nullptr, LO_MAX_CONNECTIONS},
+            {"listen-backlog",     required_argument, nullptr, LO_LISTEN_BACKLOG},
+            {"rate-limit",         required_argument, nullptr, LO_RATE_LIMIT},
+            {"ip-rate-limit",      required_argument, nullptr, LO_IP_RATE_LIMIT},
+            {"queue-timeout",      required_argument, nullptr, LO_QUEUE_TIMEOUT},
+            {"stale-while-revalidate", no_argument,   nullptr, LO_STALE_WHILE_REVALIDATE},
+            {"max-stale",          required_argument, nullptr, LO_MAX_STALE},
             {nullptr, 0, nullptr,                              0}
         };
 
@@ -123,6 +228,14 @@ int main(int argc, char *argv[]) {
                     verbose = true;
                     continue;
 
+                case LO_SYSLOG:
+                    useSyslog = true;
+                    continue;
+
+                case LO_STALE_WHILE_REVALIDATE:
+                    staleWhileRevalidate = true;
+                    continue;
+
                 default:
                     break;
             }
@@ -140,6 +253,8 @@ int main(int argc, char *argv[]) {
                         deviceType = DeviceType::Serial;
                     else if (arg == "pseudo")
                         deviceType = DeviceType::Pseudo;
+                    else if (arg == "sim")
+                        deviceType = DeviceType::Simulated;
                     else
                         throw std::invalid_argument("invalid device");
 
@@ -153,6 +268,10 @@ int main(int argc, char *argv[]) {
                     cacheTimeout = std::stoull(arg);
                     break;
 
+                case LO_FACTS_CACHE_TIMEOUT:
+                    factsCacheTimeout = std::stoull(arg);
+                    break;
+
                 case LO_DELAY:
                     delay = std::stoull(arg);
                     break;
@@ -190,9 +309,7 @@ int main(int argc, char *argv[]) {
                     break;
 
                 case LO_SERIAL_BAUD_RATE:
-                    serialBaudRate = static_cast<voltronic::SerialBaudRate>(std::stoul(arg));
-                    if (!voltronic::is_serial_baud_rate_valid(serialBaudRate))
-                        throw std::invalid_argument("invalid serial baud rate");
+                    serialBaudRate = serial_baud_rate_from_string(arg);
                     break;
 
                 case LO_SERIAL_DATA_BITS:
@@ -212,6 +329,62 @@ int main(int argc, char *argv[]) {
                         throw std::invalid_argument("invalid serial stop bits");
                     break;
 
+                case LO_STATE_DIR:
+                    stateDir = arg;
+                    break;
+
+                case LO_STATS_INTERVAL:
+                    statsInterval = std::stoull(arg);
+                    break;
+
+                case LO_QUEUE_DEPTH:
+                    queueDepth = std::stoul(arg);
+                    break;
+
+                case LO_MAX_CONNECTIONS:
+                    maxConnections = std::stoul(arg);
+                    break;
+
+                case LO_LISTEN_BACKLOG:
+                    listenBacklog = std::stoi(arg);
+                    break;
+
+                case LO_RATE_LIMIT:
+                    rateLimit = std::stod(arg);
+                    break;
+
+                case LO_IP_RATE_LIMIT:
+                    ipRateLimit = std::stod(arg);
+                    break;
+
+                case LO_QUEUE_TIMEOUT:
+                    queueTimeout = std::stoull(arg);
+                    break;
+
+                case LO_MAX_STALE:
+                    maxStale = std::stoull(arg);
+                    break;
+
+                case LO_SIM_LATENCY:
+                    simFaults.latency = std::stoull(arg);
+                    break;
+
+                case LO_SIM_JITTER:
+                    simFaults.jitter = std::stoull(arg);
+                    break;
+
+                case LO_SIM_CRC_ERROR_RATE:
+                    simFaults.crcErrorRate = rate_from_string(arg);
+                    break;
+
+                case LO_SIM_TRUNCATE_RATE:
+                    simFaults.truncateRate = rate_from_string(arg);
+                    break;
+
+                case LO_SIM_TIMEOUT_RATE:
+                    simFaults.timeoutRate = rate_from_string(arg);
+                    break;
+
                 case LO_SERIAL_PARITY:
                     if (arg == "none")
                         serialParity = voltronic::SerialParity::None;
@@ -228,13 +401,38 @@ int main(int argc, char *argv[]) {
                     break;
 
                 case LO_HOST:
-                    host = arg;
+                    hosts.push_back(arg);
                     break;
 
                 case LO_PORT:
                     port = std::stoi(arg);
                     break;
 
+                case LO_UNIX_SOCKET:
+                    unixSocket = arg;
+                    break;
+
+                case LO_ACCESS_LOG:
+                    accessLog = arg;
+                    break;
+
+                case LO_SHM_NAME:
+                    shmName = arg;
+                    break;
+
+                case LO_SHM_INTERVAL:
+                    shmInterval = std::stoull(arg);
+                    break;
+
+                case LO_EVENTS_INTERVAL:
+                    eventsInterval = std::stoull(arg);
+                    break;
+
+                case LO_CONTROL_UIDS:
+                    for (const auto& uid: split(arg, ','))
+                        controlUids.push_back(static_cast<uid_t>(std::stoul(uid)));
+                    break;
+
                 default:
                     break;
             }
@@ -242,26 +440,46 @@ int main(int argc, char *argv[]) {
 
         if (optind < argc)
             throw std::invalid_argument("extra parameter found");
+
+        if (hosts.empty())
+            hosts.emplace_back(DEFAULT_HOST);
     } catch (std::invalid_argument& e) {
         myerr << "error: " << e.what();
         return 1;
     }
 
+    // from here on, logging must not hold up the device and connections
+    logging::set_level(verbose ? logging::Level::Debug : logging::Level::Info);
+    if (useSyslog)
+        logging::use_syslog("inverterd");
+    logging::start_async();
+
     // open device
     std::shared_ptr<voltronic::Device> dev;
+    std::string deviceId;
     try {
         switch (deviceType) {
             case DeviceType::USB:
                 if (usbDevicePath.empty()) {
                     dev = std::shared_ptr<voltronic::Device>(new voltronic::USBDevice(usbVendorId,
                                                                                       usbDeviceId));
+                    std::ostringstream id;
+                    id << std::hex << std::setfill('0') << "usb-" << std::setw(4) << usbVendorId << "-" << std::setw(4) << usbDeviceId;
+                    deviceId = id.str();
                 } else {
                     dev = std::shared_ptr<voltronic::Device>(new voltronic::USBDevice(usbDevicePath));
+                    deviceId = usbDevicePath;
                 }
                 break;
 
             case DeviceType::Pseudo:
                 dev = std::shared_ptr<voltronic::Device>(new voltronic::PseudoDevice);
+                deviceId = "pseudo";
+                break;
+
+            case DeviceType::Simulated:
+                dev = std::shared_ptr<voltronic::Device>(new voltronic::SimulatedDevice(simFaults));
+                deviceId = "sim";
                 break;
 
             case DeviceType::Serial:
@@ -270,10 +488,16 @@ int main(int argc, char *argv[]) {
                                                                                      serialDataBits,
                                                                                      serialStopBits,
                                                                                      serialParity));
+                deviceId = serialDeviceName;
                 break;
         }
 
         dev->setTimeout(timeout);
+
+        if (deviceType == DeviceType::Serial && serialBaudRate == voltronic::SerialDevice::BAUD_RATE_AUTO) {
+            auto serialDevice = std::static_pointer_cast<voltronic::SerialDevice>(dev);
+            serial_baud_rate_detect(*serialDevice, stateDir, verbose);
+        }
     }
     catch (voltronic::DeviceError& e) {
         myerr << "device error: " << e.what();
@@ -300,8 +524,24 @@ int main(int argc, char *argv[]) {
     server.setDelay(delay);
     server.setDeviceErrorLimit(deviceErrorLimit);
     server.setCacheTimeout(cacheTimeout);
-
-    server.start(host, port);
+    server.setFactsCacheTimeout(factsCacheTimeout);
+    server.setStateDir(stateDir, deviceId);
+    server.setStaleWhileRevalidate(staleWhileRevalidate);
+    server.setMaxStale(maxStale);
+    server.setStatsInterval(statsInterval);
+    server.setQueueDepth(queueDepth);
+    server.setUnixSocket(unixSocket);
+    server.setSharedMemory(shmName, shmInterval);
+    server.setAccessLog(accessLog);
+    server.setEventsInterval(eventsInterval);
+    server.setControlUids(controlUids);
+    server.setMaxConnections(maxConnections);
+    server.setListenBacklog(listenBacklog);
+    server.setConnectionRateLimit(rateLimit);
+    server.setIpRateLimit(ipRateLimit);
+    server.setQueueTimeout(queueTimeout);
+
+    server.start(hosts, port);
 
     if (verbose)
         mylog << "done";
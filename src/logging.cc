@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <syslog.h>
+#include <sys/types.h>
+
+#include "logging.h"
+#include "numeric_types.h"
+
+namespace logging {
+
+/**
+ * Bounded lock-free queue of lines, any thread may push, only the writer
+ * thread pops. Slots keep their strings between uses, so once they've grown
+ * to the usual line length queueing a line doesn't allocate.
+ */
+class LineQueue {
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        Level level;
+        std::string_view method;
+        std::string line;
+    };
+
+    std::array<Slot, 1024> slots_;
+    std::atomic<size_t> head_;
+    size_t tail_;
+
+public:
+    LineQueue() : head_(0), tail_(0) {
+        for (size_t i = 0; i < slots_.size(); i++)
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // returns false if the queue is full
+    bool push(Level level, std::string_view method, const std::string& line) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots_[pos % slots_.size()];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<ssize_t>(seq) - static_cast<ssize_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->level = level;
+        slot->method = method;
+        slot->line.assign(line);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // calls f(level, method, line) for the next line, returns false if there's none
+    template <typename F>
+    bool pop(F f) {
+        Slot& slot = slots_[tail_ % slots_.size()];
+        if (slot.seq.load(std::memory_order_acquire) != tail_ + 1)
+            return false;
+
+        f(slot.level, slot.method, slot.line);
+        slot.seq.store(tail_ + slots_.size(), std::memory_order_release);
+        tail_++;
+        return true;
+    }
+};
+
+
+class Logger {
+private:
+    LineQueue queue_;
+    std::thread writer_;
+    std::atomic<bool> async_;
+    std::atomic<bool> running_;
+    std::atomic<bool> sleeping_;
+    std::atomic<u64> dropped_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool syslog_;
+
+    void output(Level level, std::string_view method, const std::string& line) {
+        if (syslog_) {
+            int priority = level == Level::Error ? LOG_ERR : (level == Level::Info ? LOG_INFO : LOG_DEBUG);
+            syslog(priority, "%.*s(): %s", static_cast<int>(method.size()), method.data(), line.c_str());
+            return;
+        }
+
+        std::ostream& os = level == Level::Error ? std::cerr : std::cout;
+        os << method << "(): " << line << '\n';
+    }
+
+    void flush() {
+        if (!syslog_) {
+            std::cout.flush();
+            std::cerr.flush();
+        }
+    }
+
+    void loop() {
+        auto f = [this](Level level, std::string_view method, const std::string& line) {
+            output(level, method, line);
+        };
+
+        for (;;) {
+            bool any = false;
+            while (queue_.pop(f))
+                any = true;
+
+            u64 dropped = dropped_.exchange(0);
+            if (dropped)
+                output(Level::Error, "logging::Logger::loop", std::to_string(dropped) + " lines dropped, queue is full");
+
+            if (any || dropped)
+                flush();
+
+            if (!running_.load())
+                break;
+
+            if (!any) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                sleeping_.store(true);
+                // a notification may be missed between pop() and here, hence the timeout
+                cv_.wait_for(lock, std::chrono::milliseconds(50));
+                sleeping_.store(false);
+            }
+        }
+
+        // whatever has been pushed before stop() was called
+        while (queue_.pop(f));
+        flush();
+    }
+
+public:
+    Logger() : async_(false), running_(false), sleeping_(false), dropped_(0), syslog_(false) {}
+
+    void setSyslog(const char* ident) {
+        openlog(ident, LOG_PID, LOG_DAEMON);
+        syslog_ = true;
+    }
+
+    void start() {
+        if (async_.load())
+            return;
+        running_.store(true);
+        writer_ = std::thread(&Logger::loop, this);
+        async_.store(true);
+    }
+
+    void stop() {
+        if (!async_.exchange(false))
+            return;
+        running_.store(false);
+        cv_.notify_one();
+        writer_.join();
+    }
+
+    void write(Level level, std::string_view method, const std::string& line) {
+        if (async_.load(std::memory_order_acquire)) {
+            if (!queue_.push(level, method, line))
+                dropped_++;
+            else if (sleeping_.load(std::memory_order_relaxed))
+                cv_.notify_one();
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        output(level, method, line);
+        flush();
+    }
+};
+
+static Logger& logger() {
+    static Logger logger;
+    return logger;
+}
+
+void set_level(Level level) {
+    min_level.store(level);
+}
+
+void start_async() {
+    static std::once_flag once;
+    logger().start();
+    std::call_once(once, []() { atexit(stop); });
+}
+
+void stop() {
+    logger().stop();
+}
+
+void use_syslog(const char* ident) {
+    logger().setSyslog(ident);
+}
+
+void write(Level level, std::string_view method, const std::string& line) {
+    if (enabled(level))
+        logger().write(level, method, line);
+}
+
+}
+
+
+/**
+ * custom_log
+ */
+
+// lines are built in strings that are kept around for the next lines of the
+// same thread, a stack of them in case a line is logged while formatting another
+static thread_local std::vector<std::string> free_lines;
+
+static std::string take_line() {
+    if (free_lines.empty())
+        return std::string();
+    std::string line = std::move(free_lines.back());
+    free_lines.pop_back();
+    return line;
+}
+
+custom_log::custom_log(logging::Level level, std::string_view method)
+    : level_(level), method_(method), line_(take_line()), buf_(line_), os_(&buf_) {}
+
+custom_log::~custom_log() {
+    logging::write(level_, method_, line_);
+    line_.clear();
+    free_lines.push_back(std::move(line_));
+}
@@ -3,19 +3,81 @@
 #ifndef INVERTER_TOOLS_LOGGING_H
 #define INVERTER_TOOLS_LOGGING_H
 
-#include <iostream>
+#include <atomic>
+#include <ostream>
+#include <streambuf>
 #include <string>
 #include <string_view>
 
+namespace logging {
+
+enum class Level {
+    Debug,
+    Info,
+    Error,
+};
+
+inline std::atomic<Level> min_level {Level::Info};
+
+inline bool enabled(Level level) {
+    return level >= min_level.load(std::memory_order_relaxed);
+}
+
+void set_level(Level level);
+
+// from now on lines are queued and written by a background thread, so that
+// logging never blocks on the terminal or on a pipe; what's left in the queue
+// is written out by stop(), which is also called at exit
+void start_async();
+void stop();
+
+// send everything to syslog (which is where journald picks it up too)
+// instead of stdout and stderr
+void use_syslog(const char* ident);
+
+void write(Level level, std::string_view method, const std::string& line);
+
+// appends everything written to it to a string
+class line_buf : public std::streambuf {
+private:
+    std::string& s_;
+
+protected:
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            s_.push_back(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        s_.append(s, static_cast<size_t>(n));
+        return n;
+    }
+
+public:
+    explicit line_buf(std::string& s) : s_(s) {}
+};
+
+constexpr std::string_view method_name(std::string_view function, std::string_view pretty) {
+    size_t locFunName = pretty.find(function);
+    size_t begin = pretty.rfind(' ', locFunName) + 1;
+    size_t end = pretty.find('(', locFunName + function.length());
+    return pretty.substr(begin, end - begin);
+}
+
+}
+
 class custom_log
 {
 private:
-    std::ostream& os_;
+    logging::Level level_;
+    std::string_view method_;
+    std::string line_;
+    logging::line_buf buf_;
+    std::ostream os_;
 
 public:
-    custom_log(std::ostream& os, const std::string& func) : os_(os) {
-        os_ << func << ": ";
-    }
+    custom_log(logging::Level level, std::string_view method);
 
     template <class T>
     custom_log &operator<<(const T &v) {
@@ -23,21 +85,22 @@ public:
         return *this;
     }
 
-    ~custom_log() {
-        os_ << std::endl;
-    }
+    ~custom_log();
 };
 
-inline std::string method_name(const std::string& function, const std::string& pretty) {
-    size_t locFunName = pretty.find(function);
-    size_t begin = pretty.rfind(" ", locFunName) + 1;
-    size_t end = pretty.find("(", locFunName + function.length());
-    return pretty.substr(begin, end - begin) + "()";
- }
+// evaluated at compile time, once per call site
+#define __METHOD_NAME__ __extension__ ({                                         \
+        static constexpr std::string_view method_name_ =                         \
+            ::logging::method_name(__FUNCTION__, __PRETTY_FUNCTION__);           \
+        method_name_;                                                            \
+    })
 
-#define __METHOD_NAME__ method_name(__FUNCTION__, __PRETTY_FUNCTION__)
+#define mylog custom_log(logging::Level::Info, __METHOD_NAME__)
+#define myerr custom_log(logging::Level::Error, __METHOD_NAME__)
 
-#define mylog custom_log(std::cout, __METHOD_NAME__)
-#define myerr custom_log(std::cerr, __METHOD_NAME__)
+// arguments are not even evaluated unless debug logging is on
+#define mydebug \
+    if (!logging::enabled(logging::Level::Debug)) {} \
+    else custom_log(logging::Level::Debug, __METHOD_NAME__)
 
 #endif //INVERTER_TOOLS_LOGGING_H
@@ -1,18 +1,23 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <atomic>
 #include <memory>
 #include <utility>
-#include <sstream>
-#include <iomanip>
+#include <algorithm>
+#include <cstring>
 #include <cmath>
 #include <stdexcept>
 
 #include "client.h"
 #include "types.h"
 #include "defines.h"
+#include "commands.h"
+#include "functions.h"
+#include "frames.h"
 #include "exceptions.h"
 #include "response.h"
 #include "../voltronic/crc.h"
+#include "../voltronic/time.h"
 
 #define MKRESPONSE(type) std::shared_ptr<response_type::BaseResponse>(new response_type::type(raw, rawSize))
 
@@ -28,35 +33,110 @@ void Client::setDevice(std::shared_ptr<voltronic::Device> device) {
     device_ = std::move(device);
 }
 
+const ClientTimings& Client::getTimings() const {
+    return timings_;
+}
+
+const voltronic::DeviceTimings& Client::getDeviceTimings() const {
+    return device_->getTimings();
+}
+
 std::shared_ptr<response_type::BaseResponse> Client::execute(p18::CommandType commandType, std::vector<std::string>& arguments) {
-    std::ostringstream buf;
-    buf << std::setfill('0');
+    timings_ = ClientTimings();
+    u64 time = voltronic::timestamp_us();
+
+    // the previous response is still held by whoever it was returned to,
+    // so it's left to them and a new one is allocated
+    auto& pooled = pool_[command_index(commandType)];
+    if (pooled && pooled.use_count() > 1)
+        pooled.reset();
+
+    // use_count() is a relaxed load. The last reader in another thread may
+    // have only just dropped its reference, and its reads of the buffer must
+    // happen before we overwrite it. This fence pairs with the release done
+    // when that reference was dropped.
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    std::shared_ptr<char> buf = pooled
+        ? pooled->getRawBuffer()
+        : std::shared_ptr<char>(new char[MAX_RESPONSE_SIZE], std::default_delete<char[]>());
+
+    size_t responseSize;
+    const PrecomputedFrame* precomputed = precomputed_frame(commandType);
+
+    // precomputed frames have crc in them, which is not always wanted
+    if (precomputed != nullptr && (device_->getFlags() & voltronic::FLAG_WRITE_CRC)) {
+        responseSize = runOnDevice(precomputed->data.data(), precomputed->size, true, buf.get());
+    } else {
+        char frame[MAX_REQUEST_SIZE];
+        size_t frameSize = pack(commandType, arguments, frame, sizeof(frame));
+
+        u64 now = voltronic::timestamp_us();
+        timings_.pack = now - time;
+        time = now;
+
+        responseSize = runOnDevice(reinterpret_cast<const u8*>(frame), frameSize, false, buf.get());
+    }
 
-    int iCommandType = static_cast<int>(commandType);
-    bool isSetCommand = iCommandType >= 100;
+    u64 now = voltronic::timestamp_us();
+    timings_.device = now - time;
+    time = now;
 
-    auto pos = raw_commands.find(commandType);
-    if (pos == raw_commands.end())
-        throw std::runtime_error("packedCommand " + std::to_string(iCommandType) + " not found");
+    std::shared_ptr<response_type::BaseResponse> response;
+    if (pooled) {
+        response = pooled;
+        response->reset(responseSize);
+    } else {
+        response = createResponse(commandType, buf, responseSize);
+        pooled = response;
+    }
 
-    std::string packedCommand = pos->second;
-    std::string packedArguments = packArguments(commandType, arguments);
+    if (!response->validate())
+        throw InvalidResponseError("validate() failed");
 
-    size_t len = sizeof(voltronic::CRC) + 1 + packedCommand.size() + packedArguments.size();
+    now = voltronic::timestamp_us();
+    timings_.validate = now - time;
+    time = now;
 
-    buf << "^";
-    buf << (isSetCommand ? "S" : "P");
-    buf << std::setw(3) << len;
-    buf << packedCommand;
-    buf << packedArguments;
+    // std::stoul() and friends throw std::logic_error subclasses on malformed
+    // fields, which are no different from any other parse error here
+    try {
+        response->unpack();
+    }
+    catch (std::logic_error& e) {
+        throw ParseError("while parsing " + std::string(command_name(commandType)) + ": " + e.what());
+    }
+    timings_.parse = voltronic::timestamp_us() - time;
 
-    std::string packed = buf.str();
+    return response;
+}
 
-    auto result = runOnDevice(packed);
-    std::shared_ptr<response_type::BaseResponse> response;
+size_t Client::pack(p18::CommandType commandType, const std::vector<std::string>& arguments, char* buf, size_t bufSize) {
+    FrameWriter w(buf, bufSize);
+
+    w.put('^');
+    w.put(is_set_command(commandType) ? 'S' : 'P');
+
+    // length goes here, once it's known
+    size_t lengthPos = w.size();
+    w.put("000");
+
+    w.put(raw_command(commandType));
+    packArguments(commandType, arguments, w);
 
-    const auto raw = result.first;
-    const auto rawSize = result.second;
+    size_t len = sizeof(voltronic::CRC) + 1 + w.size() - (lengthPos + 3);
+    if (len > 999)
+        throw std::length_error("request is too long");
+
+    buf[lengthPos] = static_cast<char>('0' + len / 100);
+    buf[lengthPos + 1] = static_cast<char>('0' + len / 10 % 10);
+    buf[lengthPos + 2] = static_cast<char>('0' + len % 10);
+
+    return w.size();
+}
+
+std::shared_ptr<response_type::BaseResponse> Client::createResponse(p18::CommandType commandType, std::shared_ptr<char> raw, size_t rawSize) {
+    std::shared_ptr<response_type::BaseResponse> response;
 
     switch (commandType) {
         RESPONSE_CASE(ProtocolID)
@@ -105,27 +185,24 @@ std::shared_ptr<response_type::BaseResponse> Client::execute(p18::CommandType co
             break;
     }
 
-    if (!response->validate())
-        throw InvalidResponseError("validate() failed");
-
-    response->unpack();
-    return std::move(response);
+    return response;
 }
 
 std::pair<std::shared_ptr<char>, size_t> Client::runOnDevice(std::string& raw) {
-    size_t bufSize = 256;
-    std::shared_ptr<char> buf(new char[bufSize]);
-    size_t responseSize = device_->run(
-            (const u8*)raw.c_str(), raw.size(),
-            (u8*)buf.get(), bufSize);
-
+    std::shared_ptr<char> buf(new char[MAX_RESPONSE_SIZE], std::default_delete<char[]>());
+    size_t responseSize = runOnDevice(reinterpret_cast<const u8*>(raw.c_str()), raw.size(), false, buf.get());
     return std::pair<std::shared_ptr<char>, size_t>(buf, responseSize);
 }
 
-std::string Client::packArguments(p18::CommandType commandType, std::vector<std::string>& arguments) {
-    std::ostringstream buf;
-    buf << std::setfill('0');
+// buf must be at least MAX_RESPONSE_SIZE bytes long
+size_t Client::runOnDevice(const u8* frame, size_t frameSize, bool complete, char* buf) {
+    auto outbuf = reinterpret_cast<u8*>(buf);
+    return complete
+        ? device_->runFrame(frame, frameSize, outbuf, MAX_RESPONSE_SIZE)
+        : device_->run(frame, frameSize, outbuf, MAX_RESPONSE_SIZE);
+}
 
+void Client::packArguments(p18::CommandType commandType, const std::vector<std::string>& arguments, FrameWriter& w) {
     switch (commandType) {
         case CommandType::GetYearGenerated:
         case CommandType::SetOutputSourcePriority:
@@ -133,70 +210,72 @@ std::string Client::packArguments(p18::CommandType commandType, std::vector<std:
         case CommandType::SetACInputVoltageRange:
         case CommandType::SetBatteryType:
         case CommandType::SetACSupply:
-            buf << arguments[0];
+            w.put(arguments[0]);
             break;
 
         case CommandType::GetMonthGenerated:
         case CommandType::GetDayGenerated:
-            buf << arguments[0];
+            w.put(arguments[0]);
             for (int i = 1; i <= (commandType == CommandType::GetMonthGenerated ? 1 : 2); i++)
-                buf << std::setw(2) << std::stoi(arguments[i]);
+                w.putNumber(std::stoi(arguments[i]), 2);
             break;
 
         case CommandType::GetParallelGeneralStatus:
         case CommandType::GetParallelRatedInformation:
-            buf << std::stoi(arguments[0]);
+            w.putNumber(std::stoi(arguments[0]));
             break;
 
         case CommandType::SetFlag:
-            buf << (arguments[1] == "1" ? "E" : "D");
-            buf << arguments[0];
+            w.put(arguments[1] == "1" ? 'E' : 'D');
+            w.put(arguments[0]);
             break;
 
         case CommandType::SetBatteryMaxChargeCurrent:
         case CommandType::SetBatteryMaxACChargeCurrent:
-            buf << arguments[0] << ",";
-            buf << std::setw(3) << std::stoi(arguments[1]);
+            w.put(arguments[0]);
+            w.put(',');
+            w.putNumber(std::stoi(arguments[1]), 3);
             break;
 
         case CommandType::SetACOutputFreq:
-            buf << std::setw(2) << std::stoi(arguments[0]);
+            w.putNumber(std::stoi(arguments[0]), 2);
             break;
 
         case CommandType::SetBatteryMaxChargeVoltage:
         case CommandType::SetBatteryChargeThresholds: {
             for (int i = 0; i < 2; i++) {
                 double val = std::stod(arguments[i]);
-                buf << std::setw(3) << (int)round(val*10);
+                w.putNumber((int)round(val*10), 3);
                 if (i == 0)
-                    buf << ",";
+                    w.put(',');
             }
             break;
         }
 
         case CommandType::SetACOutputVoltage: {
-            buf << std::setw(4) << (std::stoi(arguments[0])*10);
+            w.putNumber(std::stoi(arguments[0])*10, 4);
             break;
         }
 
         case CommandType::SetChargeSourcePriority:
         case CommandType::SetOutputMode:
-            buf << arguments[0] << "," << arguments[1];
+            w.put(arguments[0]);
+            w.put(',');
+            w.put(arguments[1]);
             break;
 
         case CommandType::SetBatteryCutOffVoltage: {
             double v = std::stod(arguments[0]);
-            buf << std::setw(3) << ((int)round(v*10));
+            w.putNumber((int)round(v*10), 3);
             break;
         }
 
         case CommandType::SetSolarConfig: {
             size_t len = arguments[0].size();
-            buf << std::setw(2) << len << arguments[0];
-            if (len < 20) {
-                for (int i = 0; i < 20-len; i++)
-                    buf << "0";
-            }
+            w.putNumber(static_cast<long>(len), 2);
+            w.put(arguments[0]);
+            for (size_t i = len; i < 20; i++)
+                w.put('0');
             break;
         }
 
@@ -205,7 +284,7 @@ std::string Client::packArguments(p18::CommandType commandType, std::vector<std:
                 int val = std::stoi(arguments[i]);
                 if (i == 0)
                     val -= 2000;
-                buf << std::setw(2) << val;
+                w.putNumber(val, 2);
             }
             break;
         }
@@ -213,17 +292,67 @@ std::string Client::packArguments(p18::CommandType commandType, std::vector<std:
         case CommandType::SetACChargeTimeBucket:
         case CommandType::SetACSupplyTimeBucket:
             for (int i = 0; i < 4; i++) {
-                buf << std::setw(2) << std::stoi(arguments[i]);
+                w.putNumber(std::stoi(arguments[i]), 2);
                 if (i == 1)
-                    buf << ",";
+                    w.put(',');
             }
             break;
 
         default:
             break;
     }
+}
+
+
+/**
+ * FrameWriter
+ */
+
+void FrameWriter::reserve(size_t size) {
+    if (pos_ + size > size_)
+        throw std::length_error("request is too long");
+}
+
+void FrameWriter::put(char c) {
+    reserve(1);
+    buf_[pos_++] = c;
+}
+
+void FrameWriter::put(const char* s) {
+    put(s, strlen(s));
+}
 
-    return buf.str();
+void FrameWriter::put(const std::string& s) {
+    put(s.c_str(), s.size());
 }
 
-}
\ No newline at end of file
+void FrameWriter::put(const char* s, size_t len) {
+    reserve(len);
+    memcpy(&buf_[pos_], s, len);
+    pos_ += len;
+}
+
+// same as `std::setfill('0') << std::setw(width) << value`
+void FrameWriter::putNumber(long value, unsigned width) {
+    char digits[24];
+    size_t n = 0;
+
+    bool negative = value < 0;
+    unsigned long v = negative ? -static_cast<unsigned long>(value) : static_cast<unsigned long>(value);
+    do {
+        digits[n++] = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    size_t len = n + (negative ? 1 : 0);
+    reserve(std::max<size_t>(len, width));
+
+    if (negative)
+        buf_[pos_++] = '-';
+    for (size_t i = len; i < width; i++)
+        buf_[pos_++] = '0';
+    while (n)
+        buf_[pos_++] = digits[--n];
+}
+
+}
@@ -5,8 +5,10 @@
 
 #include "../voltronic/device.h"
 #include "types.h"
+#include "defines.h"
 #include "response.h"
 
+#include <array>
 #include <memory>
 #include <vector>
 #include <string>
@@ -14,15 +16,64 @@
 
 namespace p18 {
 
+// durations of the last execute() stages, in microseconds
+struct ClientTimings {
+    u64 pack = 0;
+    u64 device = 0;
+    u64 validate = 0;
+    u64 parse = 0;
+};
+
+// writes a request into a fixed buffer, throws std::length_error if it doesn't fit
+class FrameWriter {
+private:
+    char* buf_;
+    size_t size_;
+    size_t pos_;
+
+    void reserve(size_t size);
+
+public:
+    FrameWriter(char* buf, size_t size) : buf_(buf), size_(size), pos_(0) {}
+
+    void put(char c);
+    void put(const char* s);
+    void put(const char* s, size_t len);
+    void put(const std::string& s);
+    void putNumber(long value, unsigned width = 0);
+
+    size_t size() const { return pos_; }
+};
+
 class Client {
 private:
     std::shared_ptr<voltronic::Device> device_;
-    static std::string packArguments(p18::CommandType commandType, std::vector<std::string>& arguments);
+    ClientTimings timings_;
+
+    // last response of each command, decoded again in place by the next
+    // execute() if nobody else holds it by then
+    std::array<std::shared_ptr<response_type::BaseResponse>, COMMANDS_COUNT> pool_;
+
+    static void packArguments(p18::CommandType commandType, const std::vector<std::string>& arguments, FrameWriter& w);
+    size_t runOnDevice(const u8* frame, size_t frameSize, bool complete, char* buf);
 
 public:
+    // the longest request is set-solar-configuration, ~30 bytes
+    static const size_t MAX_REQUEST_SIZE = 64;
+    static const size_t MAX_RESPONSE_SIZE = 256;
+
+    // writes the request frame (without crc and CR, these are added by the
+    // device) into buf, returns its size
+    static size_t pack(p18::CommandType commandType, const std::vector<std::string>& arguments, char* buf, size_t bufSize);
+
     void setDevice(std::shared_ptr<voltronic::Device> device);
+    const ClientTimings& getTimings() const;
+    const voltronic::DeviceTimings& getDeviceTimings() const;
     std::shared_ptr<response_type::BaseResponse> execute(p18::CommandType commandType, std::vector<std::string>& arguments);
     std::pair<std::shared_ptr<char>, size_t> runOnDevice(std::string& raw);
+
+    // creates response object of the right type, it's up to the caller to validate() and unpack() it
+    static std::shared_ptr<response_type::BaseResponse> createResponse(p18::CommandType commandType, std::shared_ptr<char> raw, size_t rawSize);
 };
 
 }
@@ -61,6 +61,14 @@ const std::map<std::string, p18::CommandType> client_commands = {
     {"set-ac-supply-time",               p18::CommandType::SetACSupplyTimeBucket},
 };
 
+std::string command_name(CommandType commandType) {
+    for (const auto& item: client_commands) {
+        if (item.second == commandType)
+            return item.first;
+    }
+    return std::to_string(static_cast<int>(commandType));
+}
+
 static void validate_date_args(const std::string* ys, const std::string* ms, const std::string* ds) {
     static const std::string err_year = "invalid year";
     static const std::string err_month = "invalid month";
@@ -26,6 +26,8 @@ struct CommandInput {
 
 extern const std::map<std::string, p18::CommandType> client_commands;
 
+std::string command_name(CommandType commandType);
+
 static void validate_date_args(const std::string* ys, const std::string* ms, const std::string* ds);
 static void validate_time_args(const std::string* hs, const std::string* ms, const std::string* ss);
 CommandType validate_input(std::string& command, std::vector<std::string>& arguments, void* input);
@@ -7,52 +7,6 @@
 
 namespace p18 {
 
-const std::map<CommandType, std::string> raw_commands = {
-    {CommandType::GetProtocolID,               "PI"},
-    {CommandType::GetCurrentTime,              "T"},
-    {CommandType::GetTotalGenerated,           "ET"},
-    {CommandType::GetYearGenerated,            "EY"},
-    {CommandType::GetMonthGenerated,           "EM"},
-    {CommandType::GetDayGenerated,             "ED"},
-    {CommandType::GetSerialNumber,             "ID"},
-    {CommandType::GetCPUVersion,               "VFW"},
-    {CommandType::GetRatedInformation,         "PIRI"},
-    {CommandType::GetGeneralStatus,            "GS"},
-    {CommandType::GetWorkingMode,              "MOD"},
-    {CommandType::GetFaultsAndWarnings,        "FWS"},
-    {CommandType::GetFlagsAndStatuses,         "FLAG"},
-    {CommandType::GetRatedDefaults,            "DI"},
-    {CommandType::GetAllowedChargeCurrents,    "MCHGCR"},
-    {CommandType::GetAllowedACChargeCurrents,  "MUCHGCR"},
-    {CommandType::GetParallelRatedInformation, "PRI"},
-    {CommandType::GetParallelGeneralStatus,    "PGS"},
-    {CommandType::GetACChargeTimeBucket,       "ACCT"},
-    {CommandType::GetACSupplyTimeBucket,       "ACLT"},
-    {CommandType::SetACSupply,                 "LON"},
-    {CommandType::SetFlag,                     "P"},
-    {CommandType::SetDefaults,                 "PF"},
-    {CommandType::SetBatteryMaxChargeCurrent,  "MCHGC"},
-    {CommandType::SetBatteryMaxACChargeCurrent, "MUCHGC"},
-    /* The protocol documentation defines two commands, "F50" and "F60",
-       but it's identical as if there were just one "F" command with an argument. */
-    {CommandType::SetACOutputFreq,            "F"},
-    {CommandType::SetBatteryMaxChargeVoltage, "MCHGV"},
-    {CommandType::SetACOutputVoltage,         "V"},
-    {CommandType::SetOutputSourcePriority,    "POP"},
-    {CommandType::SetBatteryChargeThresholds, "BUCD"},
-    {CommandType::SetChargeSourcePriority,    "PCP"},
-    {CommandType::SetSolarPowerPriority,      "PSP"},
-    {CommandType::SetACInputVoltageRange,     "PGR"},
-    {CommandType::SetBatteryType,             "PBT"},
-    {CommandType::SetOutputMode,              "POPM"},
-    {CommandType::SetBatteryCutOffVoltage,    "PSDV"},
-    {CommandType::SetSolarConfig,             "ID"},
-    {CommandType::ClearGenerated,             "CLE"},
-    {CommandType::SetDateTime,                "DAT"},
-    {CommandType::SetACChargeTimeBucket,      "ACCT"},
-    {CommandType::SetACSupplyTimeBucket,      "ACLT"},
-};
-
 const std::array<int, 5> ac_output_voltages = {202, 208, 220, 230, 240};
 
 const std::array<float, 8> bat_ac_recharge_voltages_12v = {11, 11.3, 11.5, 11.8, 12, 12.3, 12.5, 12.8};
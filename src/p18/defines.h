@@ -8,10 +8,61 @@
 #include <array>
 
 #include "types.h"
+#include "functions.h"
 
 namespace p18 {
 
-extern const std::map<CommandType, std::string> raw_commands;
+// protocol mnemonics of the commands, indexed by command_index()
+constexpr std::array<const char*, COMMANDS_COUNT> raw_commands = {
+    "PI",      /* GetProtocolID */
+    "T",       /* GetCurrentTime */
+    "ET",      /* GetTotalGenerated */
+    "EY",      /* GetYearGenerated */
+    "EM",      /* GetMonthGenerated */
+    "ED",      /* GetDayGenerated */
+    "ID",      /* GetSerialNumber */
+    "VFW",     /* GetCPUVersion */
+    "PIRI",    /* GetRatedInformation */
+    "GS",      /* GetGeneralStatus */
+    "MOD",     /* GetWorkingMode */
+    "FWS",     /* GetFaultsAndWarnings */
+    "FLAG",    /* GetFlagsAndStatuses */
+    "DI",      /* GetRatedDefaults */
+    "MCHGCR",  /* GetAllowedChargeCurrents */
+    "MUCHGCR", /* GetAllowedACChargeCurrents */
+    "PRI",     /* GetParallelRatedInformation */
+    "PGS",     /* GetParallelGeneralStatus */
+    "ACCT",    /* GetACChargeTimeBucket */
+    "ACLT",    /* GetACSupplyTimeBucket */
+    "LON",     /* SetACSupply */
+    "P",       /* SetFlag */
+    "PF",      /* SetDefaults */
+    "MCHGC",   /* SetBatteryMaxChargeCurrent */
+    "MUCHGC",  /* SetBatteryMaxACChargeCurrent */
+    /* The protocol documentation defines two commands, "F50" and "F60",
+       but it's identical as if there were just one "F" command with an argument. */
+    "F",       /* SetACOutputFreq */
+    "MCHGV",   /* SetBatteryMaxChargeVoltage */
+    "V",       /* SetACOutputVoltage */
+    "POP",     /* SetOutputSourcePriority */
+    "BUCD",    /* SetBatteryChargeThresholds */
+    "PCP",     /* SetChargeSourcePriority */
+    "PSP",     /* SetSolarPowerPriority */
+    "PGR",     /* SetACInputVoltageRange */
+    "PBT",     /* SetBatteryType */
+    "POPM",    /* SetOutputMode */
+    "PSDV",    /* SetBatteryCutOffVoltage */
+    "ID",      /* SetSolarConfig */
+    "CLE",     /* ClearGenerated */
+    "DAT",     /* SetDateTime */
+    "ACCT",    /* SetACChargeTimeBucket */
+    "ACLT",    /* SetACSupplyTimeBucket */
+};
+static_assert(raw_commands[COMMANDS_COUNT - 1] != nullptr, "raw_commands must cover all commands");
+
+constexpr const char* raw_command(CommandType commandType) {
+    return raw_commands[command_index(commandType)];
+}
 
 extern const std::array<int, 5> ac_output_voltages;
 
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef INVERTER_TOOLS_P18_FRAMES_H
+#define INVERTER_TOOLS_P18_FRAMES_H
+
+#include <array>
+#include <cstddef>
+
+#include "types.h"
+#include "defines.h"
+#include "functions.h"
+#include "../voltronic/crc.h"
+
+namespace p18 {
+
+// get commands that take no arguments are always sent as the same bytes, so
+// their complete frames (with crc and CR) are built at compile time
+struct PrecomputedFrame {
+    std::array<u8, 16> data{};
+    size_t size = 0;
+};
+
+constexpr bool takes_arguments(CommandType commandType) {
+    switch (commandType) {
+        case CommandType::GetYearGenerated:
+        case CommandType::GetMonthGenerated:
+        case CommandType::GetDayGenerated:
+        case CommandType::GetParallelRatedInformation:
+        case CommandType::GetParallelGeneralStatus:
+            return true;
+        default:
+            return is_set_command(commandType);
+    }
+}
+
+constexpr PrecomputedFrame make_frame(CommandType commandType) {
+    PrecomputedFrame frame;
+    if (takes_arguments(commandType))
+        return frame;
+
+    const char* command = raw_command(commandType);
+    size_t commandSize = 0;
+    while (command[commandSize])
+        commandSize++;
+
+    size_t len = commandSize + sizeof(voltronic::CRC) + 1;
+    size_t pos = 0;
+
+    frame.data[pos++] = '^';
+    frame.data[pos++] = 'P';
+    frame.data[pos++] = static_cast<u8>('0' + len / 100);
+    frame.data[pos++] = static_cast<u8>('0' + len / 10 % 10);
+    frame.data[pos++] = static_cast<u8>('0' + len % 10);
+    for (size_t i = 0; i < commandSize; i++)
+        frame.data[pos++] = static_cast<u8>(command[i]);
+
+    voltronic::CRC crc = voltronic::crc_calculate(frame.data.data(), pos);
+    frame.data[pos++] = static_cast<u8>(crc >> 8);
+    frame.data[pos++] = static_cast<u8>(crc & 0xff);
+    frame.data[pos++] = '\r';
+
+    frame.size = pos;
+    return frame;
+}
+
+constexpr std::array<PrecomputedFrame, GET_COMMANDS_COUNT> make_frames() {
+    std::array<PrecomputedFrame, GET_COMMANDS_COUNT> frames{};
+    for (size_t i = 0; i < GET_COMMANDS_COUNT; i++)
+        frames[i] = make_frame(static_cast<CommandType>(i));
+    return frames;
+}
+
+inline constexpr std::array<PrecomputedFrame, GET_COMMANDS_COUNT> precomputed_frames = make_frames();
+
+// ^P005PI, crc 0x718b
+static_assert(precomputed_frames[0].size == 10
+              && precomputed_frames[0].data[7] == 0x71
+              && precomputed_frames[0].data[8] == 0x8b, "crc of precomputed frames is broken");
+
+// returns nullptr if the command has to be packed at runtime
+constexpr const PrecomputedFrame* precomputed_frame(CommandType commandType) {
+    if (is_set_command(commandType))
+        return nullptr;
+    const PrecomputedFrame& frame = precomputed_frames[command_index(commandType)];
+    return frame.size ? &frame : nullptr;
+}
+
+}
+
+#endif //INVERTER_TOOLS_P18_FRAMES_H
@@ -3,10 +3,29 @@
 #ifndef INFINISOLAR_TOOLS_P18_FUNCTIONS_H
 #define INFINISOLAR_TOOLS_P18_FUNCTIONS_H
 
+#include <cstddef>
+#include "types.h"
+
 namespace p18 {
 
 bool is_valid_parallel_id(unsigned id);
 
+constexpr bool is_set_command(CommandType commandType) {
+    return static_cast<int>(commandType) >= static_cast<int>(CommandType::SetACSupply);
+}
+
+constexpr size_t GET_COMMANDS_COUNT = static_cast<size_t>(CommandType::GetACSupplyTimeBucket) + 1;
+constexpr size_t SET_COMMANDS_COUNT = static_cast<size_t>(CommandType::SetACSupplyTimeBucket)
+                                      - static_cast<size_t>(CommandType::SetACSupply) + 1;
+constexpr size_t COMMANDS_COUNT = GET_COMMANDS_COUNT + SET_COMMANDS_COUNT;
+
+// dense index of a command, for per-command arrays
+constexpr size_t command_index(CommandType commandType) {
+    return is_set_command(commandType)
+        ? GET_COMMANDS_COUNT + static_cast<size_t>(commandType) - static_cast<size_t>(CommandType::SetACSupply)
+        : static_cast<size_t>(commandType);
+}
+
 }
 
 #endif //INFINISOLAR_TOOLS_P18_FUNCTIONS_H
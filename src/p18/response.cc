@@ -47,6 +47,11 @@ std::ostream& operator<<(std::ostream& os, FieldLength fl) {
 BaseResponse::BaseResponse(std::shared_ptr<char> raw, size_t rawSize)
     : raw_(std::move(raw)), rawSize_(rawSize) {}
 
+bool BaseResponse::sameRaw(const BaseResponse& other) const {
+    return rawSize_ == other.rawSize_
+        && (rawSize_ == 0 || memcmp(raw_.get(), other.raw_.get(), rawSize_) == 0);
+}
+
 bool GetResponse::validate() {
     if (rawSize_ < 5)
         return false;
@@ -55,12 +60,23 @@ bool GetResponse::validate() {
     if (raw[0] != '^' || raw[1] != 'D')
         return false;
 
-    char lenbuf[4];
-    memcpy(lenbuf, &raw[2], 3);
-    lenbuf[3] = '\0';
+    size_t len = 0;
+    for (int i = 2; i < 5; i++) {
+        if (raw[i] < '0' || raw[i] > '9')
+            return false;
+        len = len * 10 + (raw[i] - '0');
+    }
+
+    if (rawSize_ + 5 < len /* exclude ^Dxxx*/)
+        return false;
 
-    auto len = static_cast<size_t>(std::stoul(lenbuf));
-    return rawSize_ >= len-5 /* exclude ^Dxxx*/;
+    // responses are plain ascii, anything else is line noise
+    for (size_t i = 5; i < rawSize_; i++) {
+        if (raw[i] < 0x20 || raw[i] > 0x7e)
+            return false;
+    }
+
+    return true;
 }
 
 const char* GetResponse::getData() const {
@@ -71,6 +87,17 @@ size_t GetResponse::getDataSize() const {
     return rawSize_ - 5;
 }
 
+// for fixed width responses, that are read without getList()
+void GetResponse::checkDataSize(size_t size) const {
+    if (getDataSize() < size) {
+        std::ostringstream error;
+        error << "while parsing " << demangle_type_name(typeid(*this).name());
+        error << ": data is expected to be at least " << size << " characters long, ";
+        error << "got " << getDataSize() << " characters";
+        throw ParseError(error.str());
+    }
+}
+
 std::vector<std::string> GetResponse::getList(std::vector<FieldLength> itemLengths, int expectAtLeast) const {
     std::string buf(getData(), getDataSize());
     auto list = ::split(buf, ',');
@@ -139,6 +166,7 @@ formattable_ptr ErrorResponse::format(formatter::Format format) {
  */
 
 void ProtocolID::unpack() {
+    checkDataSize(2);
     auto data = getData();
 
     char s[4];
@@ -156,6 +184,7 @@ formattable_ptr ProtocolID::format(formatter::Format format) {
 
 
 void CurrentTime::unpack() {
+    checkDataSize(14);
     auto data = getData();
 
     std::string buf;
@@ -209,6 +238,7 @@ formattable_ptr CurrentTime::format(formatter::Format format) {
 
 
 void TotalGenerated::unpack() {
+    checkDataSize(8);
     auto data = getData();
 
     std::string buf(data, 8);
@@ -223,10 +253,13 @@ formattable_ptr TotalGenerated::format(formatter::Format format) {
 
 
 void SerialNumber::unpack() {
+    checkDataSize(2);
     auto data = getData();
 
     std::string buf(data, 2);
     size_t len = std::stoul(buf);
+    if (len > getDataSize() - 2)
+        throw ParseError("while parsing SerialNumber: length " + buf + " is out of range");
 
     id = std::string(data+2, len);
 }
@@ -439,6 +472,7 @@ formattable_ptr GeneralStatus::format(formatter::Format format) {
 
 
 void WorkingMode::unpack() {
+    checkDataSize(2);
     auto data = getData();
     mode = static_cast<p18::WorkingMode>(stou(std::string(data, 2)));
 }
@@ -631,6 +665,7 @@ formattable_ptr RatedDefaults::format(formatter::Format format) {
 
 void AllowedChargeCurrents::unpack() {
     auto list = getList({});
+    amps.clear();
     for (const std::string& i: list) {
         amps.emplace_back(stou(i));
     }
@@ -749,10 +784,9 @@ void ParallelGeneralStatus::unpack() {
     battery_power_direction = static_cast<BatteryPowerDirection>(stou(list[25]));
     dc_ac_power_direction = static_cast<DC_AC_PowerDirection>(stou(list[26]));
     line_power_direction = static_cast<LinePowerDirection>(stou(list[27]));
-    if (list.size() >= 29) {
-        max_temp_present = true;
+    max_temp_present = list.size() >= 29;
+    if (max_temp_present)
         max_temp = stou(list[28]);
-    }
 }
 
 formattable_ptr ParallelGeneralStatus::format(formatter::Format format) {
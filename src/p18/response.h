@@ -159,12 +159,23 @@ public:
     virtual bool validate() = 0;
     virtual void unpack() = 0;
     virtual formattable_ptr format(formatter::Format format) = 0;
+
+    const char* getRaw() const { return raw_.get(); }
+    size_t getRawSize() const { return rawSize_; }
+    const std::shared_ptr<char>& getRawBuffer() const { return raw_; }
+
+    // makes the object ready to validate() and unpack() a new response that
+    // has been read into the same raw buffer
+    void reset(size_t rawSize) { rawSize_ = rawSize; }
+
+    bool sameRaw(const BaseResponse& other) const;
 };
 
 class GetResponse : public BaseResponse {
 protected:
     const char* getData() const;
     size_t getDataSize() const;
+    void checkDataSize(size_t size) const;
     std::vector<std::string> getList(std::vector<FieldLength> itemLengths, int expectAtLeast = -1) const;
 
 public:
@@ -6,7 +6,7 @@
 #include <string>
 
 #define ENUM_STR(enum_type) std::ostream& operator<< (std::ostream& os, enum_type val)
-#define ENUM_STR_DEFAULT    return os << val
+#define ENUM_STR_DEFAULT    return os << static_cast<int>(val)
 
 namespace p18 {
 
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "server.h"
+#include "../logging.h"
+#include "../formatter/formatter.h"
+
+namespace server {
+
+// lines are written at least this often (ms), or once there are this many bytes of them
+static const u64 FLUSH_INTERVAL = 1000;
+static const size_t FLUSH_SIZE = 64 * 1024;
+
+const char* cache_status_to_string(CacheStatus status) {
+    switch (status) {
+        case CacheStatus::Hit: return "hit";
+        case CacheStatus::Miss: return "miss";
+        case CacheStatus::Coalesced: return "coalesced";
+        case CacheStatus::Stale: return "stale";
+        default: return nullptr;
+    }
+}
+
+AccessLog::AccessLog(std::string path) : path_(std::move(path)), stop_(false) {
+    fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ == -1)
+        throw ServerError("open(" + path_ + "): " + std::string(strerror(errno)));
+
+    buf_.reserve(FLUSH_SIZE);
+    writer_ = std::thread(&AccessLog::loop, this);
+}
+
+AccessLog::~AccessLog() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    writer_.join();
+    close(fd_);
+}
+
+void AccessLog::write(const std::string& client, const AccessRecord& record) {
+    formatter::ordered_json j = {
+        {"time", record.time},
+        {"client", client},
+        {"request", record.request},
+    };
+    if (!record.command.empty())
+        j["command"] = record.command;
+    if (const char* cache = cache_status_to_string(record.cache))
+        j["cache"] = cache;
+    j["queue_us"] = record.queueWait;
+    j["device_us"] = record.device;
+    j["format_us"] = record.format;
+    j["bytes"] = record.bytes;
+    j["result"] = record.ok ? "ok" : "error";
+    if (!record.ok)
+        j["error"] = record.error;
+
+    // command and error come from the client and may be invalid utf-8
+    std::string line = j.dump(-1, ' ', false, formatter::ordered_json::error_handler_t::replace);
+    line += '\n';
+
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buf_ += line;
+        full = buf_.size() >= FLUSH_SIZE;
+    }
+    if (full)
+        cv_.notify_one();
+}
+
+void AccessLog::loop() {
+    std::string buf;
+    buf.reserve(FLUSH_SIZE);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait_for(lock, std::chrono::milliseconds(FLUSH_INTERVAL), [this]() {
+            return stop_ || buf_.size() >= FLUSH_SIZE;
+        });
+
+        // write outside the lock, requests keep appending to the other buffer
+        buf.swap(buf_);
+        bool stop = stop_;
+        lock.unlock();
+
+        flush(buf);
+        buf.clear();
+
+        if (stop)
+            break;
+        lock.lock();
+    }
+}
+
+void AccessLog::flush(std::string& buf) {
+    const char* ptr = buf.c_str();
+    size_t left = buf.size();
+
+    while (left > 0) {
+        ssize_t written = ::write(fd_, ptr, left);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            myerr << path_ << ": " << strerror(errno) << ", " << left << " bytes of access log lost";
+            return;
+        }
+        left -= written;
+        ptr += written;
+    }
+}
+
+}
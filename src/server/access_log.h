@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef INVERTER_TOOLS_SERVER_ACCESS_LOG_H
+#define INVERTER_TOOLS_SERVER_ACCESS_LOG_H
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "../numeric_types.h"
+
+namespace server {
+
+enum class CacheStatus {
+    None,       /* not an exec request, or it failed before getting to the cache */
+    Hit,
+    Miss,       /* executed on the device */
+    Coalesced,  /* refreshed by another request while this one was in the queue */
+    Stale,      /* outdated response served with --stale-while-revalidate or
+                   because the device queue didn't let the request through */
+};
+
+const char* cache_status_to_string(CacheStatus status);
+
+// filled in while a request is handled, written out once it's answered
+struct AccessRecord {
+    u64 time = 0;                           /* ms since epoch, when the request came in */
+    std::string request;                    /* first word of the request */
+    std::string command;                    /* exec only */
+    CacheStatus cache = CacheStatus::None;
+    u64 queueWait = 0;                      /* us */
+    u64 device = 0;                         /* us */
+    u64 format = 0;                         /* us */
+    size_t bytes = 0;
+    bool ok = true;
+    std::string error;
+};
+
+
+/**
+ * Writes one JSON object per line per handled request. Lines are collected
+ * in memory and written to the file by a background thread, so requests never
+ * wait for the disk.
+ */
+class AccessLog {
+private:
+    int fd_;
+    std::string path_;
+    std::string buf_;
+    bool stop_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread writer_;
+
+    void loop();
+    void flush(std::string& buf);
+
+public:
+    // the file is opened for appending, ServerError is thrown if it can't be
+    explicit AccessLog(std::string path);
+    ~AccessLog();
+
+    AccessLog(const AccessLog&) = delete;
+    AccessLog& operator=(const AccessLog&) = delete;
+
+    void write(const std::string& client, const AccessRecord& record);
+};
+
+}
+
+#endif //INVERTER_TOOLS_SERVER_ACCESS_LOG_H
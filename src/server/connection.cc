@@ -4,13 +4,16 @@
 #include <unistd.h>
 #include <ios>
 #include <arpa/inet.h>
+#include <poll.h>
 #include <cerrno>
 
 #include "connection.h"
 #include "../p18/commands.h"
+#include "../p18/functions.h"
 #include "../p18/response.h"
 #include "../logging.h"
 #include "../common.h"
+#include "../voltronic/time.h"
 #include "hexdump/hexdump.h"
 #include "signal.h"
 
@@ -31,22 +34,42 @@
 
 namespace server {
 
-Connection::Connection(int sock, struct sockaddr_in addr, Server* server)
+Connection::Connection(int sock, const struct sockaddr_storage& addr, Server* server)
     : sock_(sock), addr_(addr), server_(server)
+    , hasCredentials_(false), uid_(0), pid_(0), probeSent_(false)
+    , rateLimit_(server->getConnectionRateLimit(), server->getConnectionRateLimit())
 {
-    if (server_->verbose())
-        mylog << "new connection from " << ipv4();
+    options_.timeout = server_->getQueueTimeout();
+
+    if (addr_.ss_family == AF_UNIX) {
+#if defined(SO_PEERCRED)
+        struct ucred cred = {0};
+        socklen_t len = sizeof(cred);
+        if (getsockopt(sock_, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+            hasCredentials_ = true;
+            uid_ = cred.uid;
+            pid_ = cred.pid;
+        }
+#else
+        gid_t gid;
+        if (getpeereid(sock_, &uid_, &gid) == 0)
+            hasCredentials_ = true;
+#endif
+        if (!hasCredentials_)
+            myerr << "failed to get peer credentials: " << strerror(errno);
+    }
+
+    mydebug << "new connection from " << address();
 
     thread_ = std::thread(&Connection::run, this);
     thread_.detach();
 }
 
 Connection::~Connection() {
-    if (server_->verbose())
-        mylog << "closing socket..";
+    mydebug << "closing socket..";
 
     if (close(sock_) == -1)
-        myerr << ipv4() << ": close: " << strerror(errno);
+        myerr << address() << ": close: " << strerror(errno);
 
     server_->removeConnection(this);
 }
@@ -59,7 +82,7 @@ void Connection::run() {
         long rcvd = readLoop(buf, bufSize - 1);
         if (rcvd == -1) {
             if (errno != EINTR && server_->verbose())
-                myerr << ipv4() << ": recv: " << std::string(strerror(errno));
+                myerr << address() << ": recv: " << std::string(strerror(errno));
             break;
         }
         if (rcvd == 0)
@@ -70,13 +93,47 @@ void Connection::run() {
             break;
 
         Response resp = processRequest(buf);
-        if (!sendResponse(resp))
+
+        u64 time = voltronic::timestamp_us();
+        bool sent = sendResponse(resp);
+
+        if (auto accessLog = server_->accessLog())
+            accessLog->write(address(), resp.access);
+
+        if (!sent)
+            break;
+
+        if (resp.hasCommand)
+            server_->stats().record(resp.commandType, Stage::SocketSend, voltronic::timestamp_us() - time);
+
+        if (resp.subscribe) {
+            streamEvents(resp.lastEventId);
             break;
+        }
     }
 
     delete this;
 }
 
+/**
+ * Sends events as they come, until the client goes away.
+ */
+void Connection::streamEvents(u64 lastId) {
+    mydebug << address() << " subscribed to events";
+
+    while (!shutdownCaught && !isStreamClosed()) {
+        auto events = server_->events().wait(lastId, 1000);
+        if (events.empty())
+            continue;
+
+        Response resp;
+        resp.type = ResponseType::OK;
+        resp.buf << EventsList(options_.format, std::move(events));
+        if (!sendResponse(resp))
+            break;
+    }
+}
+
 int Connection::readLoop(char* buf, size_t bufSize) const {
     char* bufptr = buf;
     int left = static_cast<int>(bufSize);
@@ -96,7 +153,7 @@ int Connection::readLoop(char* buf, size_t bufSize) const {
         left -= static_cast<int>(rcvd);
         bufptr += rcvd;
 
-        bufptr[rcvd] = '\0';
+        *bufptr = '\0';
         char* ptr = strstr(buf, "\r\n");
         if (ptr)
             break;
@@ -110,10 +167,10 @@ bool Connection::writeLoop(const char* buf, size_t bufSize) const {
     int left = static_cast<int>(bufSize);
 
     while (left > 0) {
-        size_t bytesSent = send(sock_, bufptr, left, 0);
+        size_t bytesSent = send(sock_, bufptr, left, MSG_NOSIGNAL);
         if (bytesSent == -1) {
             if (errno != EINTR && server_->verbose())
-                myerr << ipv4() << ": send: " << std::string(strerror(errno));
+                myerr << address() << ": send: " << std::string(strerror(errno));
             return false;
         }
 
@@ -131,21 +188,102 @@ bool Connection::sendResponse(Response& resp) const {
     std::string s = sbuf.str();
     const char* buf = s.c_str();
     size_t bufSize = s.size();
+    resp.access.bytes = bufSize;
 
     return writeLoop(buf, bufSize);
 }
 
-std::string Connection::ipv4() const {
-    char ip[INET_ADDRSTRLEN] = {0};
-    const char* result = inet_ntop(AF_INET, (const void*)&addr_.sin_addr, ip, sizeof(ip));
-    if (result == nullptr)
-        return "?";
+// Unix socket clients have no address of their own, so they are told apart by
+// uid: every local user gets a separate --ip-rate-limit bucket. Only those whose
+// credentials are unknown end up sharing one.
+std::string Connection::ip() const {
+    if (addr_.ss_family != AF_UNIX)
+        return format_address(addr_, false);
+    if (hasCredentials_)
+        return "unix:uid=" + std::to_string(uid_);
+    return "unix";
+}
+
+std::string Connection::address() const {
+    if (addr_.ss_family != AF_UNIX)
+        return format_address(addr_);
 
     std::ostringstream buf;
-    buf << ip << ":" << htons(addr_.sin_port);
+    buf << "unix";
+    if (hasCredentials_) {
+        buf << "(uid=" << uid_;
+        if (pid_)
+            buf << ",pid=" << pid_;
+        buf << ")";
+    }
     return buf.str();
 }
 
+bool Connection::getPeerUid(uid_t& uid) const {
+    if (!hasCredentials_)
+        return false;
+    uid = uid_;
+    return true;
+}
+
+// A hangup or a reset means the client is gone. EOF on the read side alone
+// doesn't: the client may have only shut down its sending side (e.g. with
+// shutdown(SHUT_WR)) and still be waiting for the answer. For unix sockets a
+// full close is reported as a hangup, but a TCP peer sends the same FIN in both
+// cases. The only way to tell is to send it something: a socket that has been
+// closed answers with a reset, which the next call will see. The probe is a
+// single byte of urgent data, which isn't part of the stream the client reads.
+bool Connection::isClosed() const {
+    struct pollfd pfd = {sock_, POLLIN, 0};
+#ifdef POLLRDHUP
+    pfd.events |= POLLRDHUP;
+#endif
+    if (poll(&pfd, 1, 0) <= 0)
+        return false;
+
+    if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+        return true;
+
+    bool eof = false;
+#ifdef POLLRDHUP
+    eof = (pfd.revents & POLLRDHUP) != 0;
+#endif
+    if (!eof && (pfd.revents & POLLIN)) {
+        char c;
+        eof = recv(sock_, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+    }
+    if (!eof || addr_.ss_family == AF_UNIX || probeSent_)
+        return false;
+
+    probeSent_ = true;
+    char probe = 0;
+    return send(sock_, &probe, 1, MSG_OOB | MSG_DONTWAIT | MSG_NOSIGNAL) == -1
+        && (errno == EPIPE || errno == ECONNRESET);
+}
+
+// A subscriber has nothing more to say, so unlike isClosed(), EOF is enough to
+// end the stream. Otherwise it would only end when sending an event fails, and
+// events may not come for days. Anything the client sends is discarded, except
+// for EOT, which closes the connection as usual.
+bool Connection::isStreamClosed() const {
+    struct pollfd pfd = {sock_, POLLIN, 0};
+#ifdef POLLRDHUP
+    pfd.events |= POLLRDHUP;
+#endif
+    if (poll(&pfd, 1, 0) <= 0)
+        return false;
+
+    if (pfd.revents & (POLLERR | POLLNVAL))
+        return true;
+
+    char buf[64];
+    ssize_t rcvd = recv(sock_, buf, sizeof(buf), MSG_DONTWAIT);
+    if (rcvd == -1)
+        return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+
+    return rcvd == 0 || memchr(buf, '\4', rcvd) != nullptr;
+}
+
 Response Connection::processRequest(char* buf) {
     std::stringstream sbuf;
     int n = 0;
@@ -154,6 +292,7 @@ Response Connection::processRequest(char* buf) {
 
     Response resp;
     resp.type = ResponseType::OK;
+    resp.access.time = voltronic::unix_timestamp();
 
     try {
         char* last = nullptr;
@@ -168,10 +307,20 @@ Response Connection::processRequest(char* buf) {
 
             if (!n++) {
                 std::string s = std::string(token);
+                resp.access.request = s;
 
                 if (s == "format")
                     type = RequestType::Format;
 
+                else if (s == "priority")
+                    type = RequestType::Priority;
+
+                else if (s == "timeout")
+                    type = RequestType::Timeout;
+
+                else if (s == "delta")
+                    type = RequestType::Delta;
+
                 else if (s == "v")
                     type = RequestType::Version;
 
@@ -181,6 +330,12 @@ Response Connection::processRequest(char* buf) {
                 else if (s == "raw")
                     type = RequestType::Raw;
 
+                else if (s == "stats")
+                    type = RequestType::Stats;
+
+                else if (s == "subscribe")
+                    type = RequestType::Subscribe;
+
                 else
                     throw std::invalid_argument("invalid token: " + s);
 
@@ -188,6 +343,9 @@ Response Connection::processRequest(char* buf) {
                 arguments.emplace_back(token);
         }
 
+        if (!n)
+            throw std::invalid_argument("empty request");
+
         switch (type) {
             case RequestType::Version: {
                 CHECK_ARGUMENTS_LENGTH(1)
@@ -201,14 +359,36 @@ Response Connection::processRequest(char* buf) {
             case RequestType::Format:
                 CHECK_ARGUMENTS_LENGTH(1)
                 options_.format = format_from_string(arguments[0]);
+                deltaState_.clear();
+                break;
+
+            case RequestType::Priority:
+                CHECK_ARGUMENTS_LENGTH(1)
+                options_.priority = priority_from_string(arguments[0]);
+                break;
+
+            case RequestType::Timeout:
+                CHECK_ARGUMENTS_LENGTH(1)
+                options_.timeout = std::stoull(arguments[0]);
+                break;
+
+            case RequestType::Delta:
+                CHECK_ARGUMENTS_LENGTH(1)
+                if (arguments[0] == "on")
+                    options_.delta = true;
+                else if (arguments[0] == "off")
+                    options_.delta = false;
+                else
+                    throw std::invalid_argument("invalid argument: expected on or off");
+                deltaState_.clear();
                 break;
 
             case RequestType::Execute: {
                 CHECK_ARGUMENTS_MIN_LENGTH(1)
 
                 std::string& command = arguments[0];
-                if (server_->verbose())
-                    mylog << "received " << command << " command";
+                mydebug << "received " << command << " command";
+                resp.access.command = command;
 
                 auto commandArguments = std::vector<std::string>();
                 auto argumentsSlice = std::vector<std::string>(arguments.begin()+1, arguments.end());
@@ -216,9 +396,53 @@ Response Connection::processRequest(char* buf) {
                 p18::CommandInput input{&argumentsSlice};
                 p18::CommandType commandType = p18::validate_input(command, commandArguments, (void*)&input);
 
-                auto response = server_->executeCommand(commandType, commandArguments);
-                resp.buf << *(response->format(options_.format).get());
+                if (p18::is_set_command(commandType) && !server_->isControlAllowed(*this))
+                    throw std::runtime_error("permission denied");
+
+                RequestContext ctx;
+                ctx.priority = options_.priority;
+                if (options_.timeout)
+                    ctx.deadline = voltronic::timestamp() + options_.timeout;
+                ctx.cancelled = [this]() { return isClosed(); };
+                ctx.clientAddress = ip();
+                ctx.rateLimit = &rateLimit_;
+                ctx.access = &resp.access;
+
+                auto cr = server_->executeCommand(commandType, commandArguments, ctx);
+
+                u64 time = voltronic::timestamp_us();
+                auto formattable = cr->response->format(options_.format);
+                if (options_.delta)
+                    formattable = applyDelta(commandType, commandArguments, formattable);
 
+                u64 age = voltronic::timestamp() - cr->time;
+                if (age > server_->getCacheTimeout(commandType))
+                    formattable->setAge(age);
+
+                resp.buf << *formattable;
+                resp.access.format = voltronic::timestamp_us() - time;
+                server_->stats().record(commandType, Stage::Format, resp.access.format);
+
+                resp.hasCommand = true;
+                resp.commandType = commandType;
+
+                break;
+            }
+
+            case RequestType::Stats:
+                CHECK_ARGUMENTS_LENGTH(0)
+                resp.buf << *(server_->stats().format(options_.format));
+                break;
+
+            case RequestType::Subscribe: {
+                if (arguments.size() > 1)
+                    throw std::invalid_argument("invalid arguments count: expected 0 or 1, got " + std::to_string(arguments.size()));
+
+                // replay buffered events newer than the given id, if any
+                resp.lastEventId = arguments.empty()
+                    ? server_->events().lastId()
+                    : std::stoull(arguments[0]);
+                resp.subscribe = true;
                 break;
             }
 
@@ -238,6 +462,8 @@ Response Connection::processRequest(char* buf) {
         myerr << e.what();
 
         resp.type = ResponseType::Error;
+        resp.access.ok = false;
+        resp.access.error = e.what();
 
         auto err = p18::response_type::ErrorResponse(e.what());
         resp.buf << *(err.format(options_.format));
@@ -246,6 +472,78 @@ Response Connection::processRequest(char* buf) {
     return resp;
 }
 
+/**
+ * Leaves only the fields that have changed since the previous response to the
+ * same command. The first response is sent in full, as are responses that
+ * aren't tables.
+ */
+p18::response_type::formattable_ptr Connection::applyDelta(p18::CommandType commandType,
+                                                           const std::vector<std::string>& arguments,
+                                                           p18::response_type::formattable_ptr formattable) {
+    using p18::response_type::VariantHolder;
+
+    auto table = std::dynamic_pointer_cast<formatter::Table<VariantHolder>>(formattable);
+    if (!table)
+        return formattable;
+
+    const auto& items = table->items();
+    std::vector<std::string> values;
+    values.reserve(items.size());
+    for (const auto& item: items)
+        values.push_back(formatter::to_str(item.value));
+
+    auto it = deltaState_.find(commandType);
+    if (it == deltaState_.end() || it->second.arguments != arguments || it->second.values.size() != values.size()) {
+        deltaState_[commandType] = {arguments, std::move(values)};
+        return formattable;
+    }
+
+    std::vector<std::pair<size_t, formatter::TableItem<VariantHolder>>> changed;
+    for (size_t i = 0; i < values.size(); i++) {
+        if (values[i] != it->second.values[i])
+            changed.emplace_back(i, items[i]);
+    }
+    it->second.values = std::move(values);
+
+    return std::make_shared<formatter::DeltaTable<VariantHolder>>(options_.format, std::move(changed));
+}
+
+std::string format_address(const struct sockaddr_storage& addr, bool withPort) {
+    char ip[INET6_ADDRSTRLEN] = {0};
+    const void* src;
+    u16 port;
+
+    switch (addr.ss_family) {
+        case AF_INET: {
+            auto sin = reinterpret_cast<const struct sockaddr_in*>(&addr);
+            src = &sin->sin_addr;
+            port = ntohs(sin->sin_port);
+            break;
+        }
+        case AF_INET6: {
+            auto sin6 = reinterpret_cast<const struct sockaddr_in6*>(&addr);
+            src = &sin6->sin6_addr;
+            port = ntohs(sin6->sin6_port);
+            break;
+        }
+        default:
+            return "?";
+    }
+
+    if (inet_ntop(addr.ss_family, src, ip, sizeof(ip)) == nullptr)
+        return "?";
+
+    if (!withPort)
+        return ip;
+
+    std::ostringstream buf;
+    if (addr.ss_family == AF_INET6)
+        buf << "[" << ip << "]:" << port;
+    else
+        buf << ip << ":" << port;
+    return buf.str();
+}
+
 std::ostream& operator<<(std::ostream& os, Response& resp) {
     os << (resp.type == ResponseType::OK ? "ok" : "err");
 
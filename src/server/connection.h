@@ -4,11 +4,19 @@
 #define INVERTER_TOOLS_CONNECTION_H
 
 #include <thread>
+#include <map>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 #include <sstream>
 
 #include "server.h"
+#include "device_queue.h"
+#include "token_bucket.h"
+#include "access_log.h"
 #include "../formatter/formatter.h"
+#include "../p18/types.h"
+#include "../p18/response.h"
 
 namespace server {
 
@@ -17,11 +25,20 @@ struct Response;
 
 struct ConnectionOptions {
     ConnectionOptions()
-        : version(1), format(formatter::Format::JSON)
+        : version(1), format(formatter::Format::JSON), priority(Priority::Interactive), timeout(0), delta(false)
     {}
 
     unsigned version;
     formatter::Format format;
+    Priority priority;
+    u64 timeout;
+    bool delta;
+};
+
+// what the client has been sent last time, for the delta mode
+struct DeltaState {
+    std::vector<std::string> arguments;
+    std::vector<std::string> values;
 };
 
 
@@ -29,27 +46,50 @@ class Connection {
 private:
     int sock_;
     std::thread thread_;
-    struct sockaddr_in addr_;
+    struct sockaddr_storage addr_;
     Server* server_;
+
+    // peer credentials, for unix socket connections
+    bool hasCredentials_;
+    uid_t uid_;
+    pid_t pid_;
+    // whether isClosed() has already sent urgent data to find out if the peer is still there
+    mutable bool probeSent_;
     ConnectionOptions options_;
+    TokenBucket rateLimit_;
+    std::map<p18::CommandType, DeltaState> deltaState_;
+
+    p18::response_type::formattable_ptr applyDelta(p18::CommandType commandType,
+                                                   const std::vector<std::string>& arguments,
+                                                   p18::response_type::formattable_ptr formattable);
 
 public:
-    explicit Connection(int sock, struct sockaddr_in addr, Server* server);
+    explicit Connection(int sock, const struct sockaddr_storage& addr, Server* server);
     ~Connection();
     void run();
-    std::string ipv4() const;
+    std::string address() const;
+    std::string ip() const;
+    bool getPeerUid(uid_t& uid) const;
+    bool isClosed() const;
+    bool isStreamClosed() const;
     bool sendResponse(Response& resp) const;
     int readLoop(char* buf, size_t bufSize) const;
     bool writeLoop(const char* buf, size_t bufSize) const;
     Response processRequest(char* buf);
+    void streamEvents(u64 lastId);
 };
 
 
 enum class RequestType {
     Version,
     Format,
+    Priority,
+    Timeout,
+    Delta,
     Execute,
     Raw,
+    Stats,
+    Subscribe,
 };
 
 
@@ -59,9 +99,22 @@ enum class ResponseType {
 };
 
 
+std::string format_address(const struct sockaddr_storage& addr, bool withPort = true);
+
+
 struct Response {
     ResponseType type;
     std::ostringstream buf;
+
+    // set for executed commands, used for stats
+    bool hasCommand = false;
+    p18::CommandType commandType;
+
+    // set when the connection turns into an event stream
+    bool subscribe = false;
+    u64 lastEventId = 0;
+
+    AccessRecord access;
 };
 std::ostream& operator<<(std::ostream& os, Response& resp);
 
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <algorithm>
+#include <chrono>
+
+#include "device_queue.h"
+#include "../voltronic/time.h"
+
+namespace server {
+
+// how often waiting requests check whether they've been cancelled, in ms
+static const u64 CANCEL_CHECK_INTERVAL = 100;
+
+Priority priority_from_string(const std::string& s) {
+    if (s == "interactive")
+        return Priority::Interactive;
+    if (s == "background")
+        return Priority::Background;
+    throw std::invalid_argument("invalid priority");
+}
+
+
+DeviceQueue::DeviceQueue()
+    : nextTicket_(0)
+    , maxDepth_(MAX_DEPTH)
+    , busy_(false)
+    , busySince_(0)
+    , busyEstimate_(0) {}
+
+void DeviceQueue::setMaxDepth(size_t maxDepth) {
+    maxDepth_ = maxDepth;
+}
+
+size_t DeviceQueue::depth() const {
+    size_t depth = 0;
+    for (const auto& q: waiting_)
+        depth += q.size();
+    return depth;
+}
+
+/**
+ * Returns how long the request will probably wait for the device: the rest of
+ * the running request plus everything queued ahead of it, in ms.
+ */
+u64 DeviceQueue::estimateWait(Priority priority, u64 ticket, u64 now) const {
+    u64 wait = 0;
+
+    if (busy_ && now - busySince_ < busyEstimate_)
+        wait += busyEstimate_ - (now - busySince_);
+
+    for (size_t i = 0; i <= static_cast<size_t>(priority); i++) {
+        for (const auto& w: waiting_[i]) {
+            if (w.ticket == ticket)
+                break;
+            wait += w.estimate;
+        }
+    }
+
+    return wait;
+}
+
+bool DeviceQueue::isNext(Priority priority, u64 ticket) const {
+    for (size_t i = 0; i < static_cast<size_t>(priority); i++) {
+        if (!waiting_[i].empty())
+            return false;
+    }
+    return waiting_[static_cast<size_t>(priority)].front().ticket == ticket;
+}
+
+void DeviceQueue::remove(Priority priority, u64 ticket) {
+    auto& q = waiting_[static_cast<size_t>(priority)];
+    q.erase(std::find_if(q.begin(), q.end(), [ticket](const Waiter& w) { return w.ticket == ticket; }));
+}
+
+void DeviceQueue::acquire(const RequestContext& ctx) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // control writes are rare and must never be turned away
+    if (ctx.priority != Priority::Control && maxDepth_ && depth() >= maxDepth_)
+        throw QueueError("busy: device queue is full");
+
+    u64 ticket = nextTicket_++;
+    waiting_[static_cast<size_t>(ctx.priority)].push_back({ticket, ctx.estimate});
+
+    while (busy_ || !isNext(ctx.priority, ticket)) {
+        u64 now = voltronic::timestamp();
+        const char* error = nullptr;
+
+        // no point in waiting if the answer won't make it in time anyway;
+        // checked on every wakeup, as more urgent requests may have cut in
+        if (ctx.deadline && now + estimateWait(ctx.priority, ticket, now) + ctx.estimate >= ctx.deadline)
+            error = "deadline can't be met";
+        else if (ctx.cancelled && ctx.cancelled())
+            error = "client has gone away";
+
+        if (error != nullptr) {
+            remove(ctx.priority, ticket);
+            // we might have been blocking someone behind us
+            cv_.notify_all();
+            throw QueueError(error);
+        }
+
+        u64 wait = CANCEL_CHECK_INTERVAL;
+        if (ctx.deadline)
+            wait = std::min(wait, ctx.deadline - now);
+
+        cv_.wait_for(lock, std::chrono::milliseconds(wait));
+    }
+
+    waiting_[static_cast<size_t>(ctx.priority)].pop_front();
+    busy_ = true;
+    busySince_ = voltronic::timestamp();
+    busyEstimate_ = ctx.estimate;
+}
+
+void DeviceQueue::release() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        busy_ = false;
+    }
+    cv_.notify_all();
+}
+
+}
@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef INVERTER_TOOLS_SERVER_DEVICE_QUEUE_H
+#define INVERTER_TOOLS_SERVER_DEVICE_QUEUE_H
+
+#include <array>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+#include "../numeric_types.h"
+
+namespace server {
+
+enum class Priority {
+    Control = 0,  /* set-* commands */
+    Interactive,
+    Background,
+};
+const size_t PRIORITIES_COUNT = static_cast<size_t>(Priority::Background) + 1;
+
+Priority priority_from_string(const std::string& s);
+
+
+class TokenBucket;
+struct AccessRecord;
+
+struct RequestContext {
+    Priority priority = Priority::Interactive;
+
+    // absolute time (voltronic::timestamp()) after which the request is no
+    // longer worth executing, 0 means no deadline
+    u64 deadline = 0;
+
+    // expected time of execution on the device in ms, 0 if unknown
+    u64 estimate = 0;
+
+    // returns true if whoever is waiting for the result has gone away
+    std::function<bool()> cancelled;
+
+    // for rate limiting of requests that have to go to the device
+    std::string clientAddress;
+    TokenBucket* rateLimit = nullptr;
+
+    // where to note how the request has been served, may be null
+    AccessRecord* access = nullptr;
+};
+
+
+/**
+ * Grants exclusive access to the device, in order of priority and, within
+ * the same priority, in order of arrival.
+ */
+class DeviceQueue {
+private:
+    struct Waiter {
+        u64 ticket;
+        u64 estimate;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::array<std::deque<Waiter>, PRIORITIES_COUNT> waiting_;
+    u64 nextTicket_;
+    size_t maxDepth_;
+    bool busy_;
+    u64 busySince_;
+    u64 busyEstimate_;
+
+    size_t depth() const;
+    u64 estimateWait(Priority priority, u64 ticket, u64 now) const;
+    bool isNext(Priority priority, u64 ticket) const;
+    void remove(Priority priority, u64 ticket);
+
+public:
+    static const size_t MAX_DEPTH = 32;
+
+    DeviceQueue();
+
+    void setMaxDepth(size_t maxDepth);
+
+    void acquire(const RequestContext& ctx);
+    void release();
+};
+
+
+class DeviceQueueLock {
+private:
+    DeviceQueue& queue_;
+
+public:
+    DeviceQueueLock(DeviceQueue& queue, const RequestContext& ctx) : queue_(queue) {
+        queue_.acquire(ctx);
+    }
+
+    // for when acquire() has already been called
+    DeviceQueueLock(DeviceQueue& queue, std::adopt_lock_t) : queue_(queue) {}
+
+    ~DeviceQueueLock() {
+        queue_.release();
+    }
+
+    DeviceQueueLock(const DeviceQueueLock&) = delete;
+    DeviceQueueLock& operator=(const DeviceQueueLock&) = delete;
+};
+
+
+class QueueError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+}
+
+#endif //INVERTER_TOOLS_SERVER_DEVICE_QUEUE_H
@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <chrono>
+
+#include "events.h"
+#include "../p18/defines.h"
+#include "../voltronic/time.h"
+
+namespace server {
+
+using namespace p18::response_type;
+
+typedef std::pair<const char*, bool FaultsAndWarnings::*> WarningField;
+typedef std::pair<const char*, bool FlagsAndStatuses::*> FlagField;
+
+static const WarningField warning_fields[] = {
+    {"line_fail",                          &FaultsAndWarnings::line_fail},
+    {"output_circuit_short",               &FaultsAndWarnings::output_circuit_short},
+    {"inverter_over_temperature",          &FaultsAndWarnings::inverter_over_temperature},
+    {"fan_lock",                           &FaultsAndWarnings::fan_lock},
+    {"battery_voltage_high",               &FaultsAndWarnings::battery_voltage_high},
+    {"battery_low",                        &FaultsAndWarnings::battery_low},
+    {"battery_under",                      &FaultsAndWarnings::battery_under},
+    {"over_load",                          &FaultsAndWarnings::over_load},
+    {"eeprom_fail",                        &FaultsAndWarnings::eeprom_fail},
+    {"power_limit",                        &FaultsAndWarnings::power_limit},
+    {"pv1_voltage_high",                   &FaultsAndWarnings::pv1_voltage_high},
+    {"pv2_voltage_high",                   &FaultsAndWarnings::pv2_voltage_high},
+    {"mppt1_overload_warning",             &FaultsAndWarnings::mppt1_overload_warning},
+    {"mppt2_overload_warning",             &FaultsAndWarnings::mppt2_overload_warning},
+    {"battery_too_low_to_charge_for_scc1", &FaultsAndWarnings::battery_too_low_to_charge_for_scc1},
+    {"battery_too_low_to_charge_for_scc2", &FaultsAndWarnings::battery_too_low_to_charge_for_scc2},
+};
+
+static const FlagField flag_fields[] = {
+    {"buzzer",                                        &FlagsAndStatuses::buzzer},
+    {"overload_bypass",                               &FlagsAndStatuses::overload_bypass},
+    {"lcd_escape_to_default_page_after_1min_timeout", &FlagsAndStatuses::lcd_escape_to_default_page_after_1min_timeout},
+    {"overload_restart",                              &FlagsAndStatuses::overload_restart},
+    {"over_temp_restart",                             &FlagsAndStatuses::over_temp_restart},
+    {"backlight_on",                                  &FlagsAndStatuses::backlight_on},
+    {"alarm_on_primary_source_interrupt",             &FlagsAndStatuses::alarm_on_primary_source_interrupt},
+    {"fault_code_record",                             &FlagsAndStatuses::fault_code_record},
+};
+
+static size_t slot(p18::CommandType commandType) {
+    switch (commandType) {
+        case p18::CommandType::GetFaultsAndWarnings: return 0;
+        case p18::CommandType::GetWorkingMode: return 1;
+        default: return 2;
+    }
+}
+
+static std::string fault_description(unsigned code) {
+    auto it = p18::fault_codes.find(static_cast<int>(code));
+    return it != p18::fault_codes.end() ? it->second : "unknown";
+}
+
+
+EventLog::EventLog() : nextId_(1) {}
+
+bool EventLog::isWatched(p18::CommandType commandType) {
+    return commandType == p18::CommandType::GetFaultsAndWarnings
+        || commandType == p18::CommandType::GetWorkingMode
+        || commandType == p18::CommandType::GetFlagsAndStatuses;
+}
+
+void EventLog::push(std::vector<Event>& events, const char* type, std::string key, std::string from, std::string to, std::string message) {
+    events.push_back({0, 0, type, std::move(key), std::move(from), std::move(to), std::move(message)});
+}
+
+void EventLog::update(p18::CommandType commandType, const std::shared_ptr<BaseResponse>& response) {
+    std::vector<Event> events;
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    auto& last = last_[slot(commandType)];
+    auto prev = last;
+    last = response;
+
+    // the first response is what everything else is compared to
+    if (!prev)
+        return;
+
+    switch (commandType) {
+        case p18::CommandType::GetFaultsAndWarnings: {
+            auto a = std::static_pointer_cast<FaultsAndWarnings>(prev);
+            auto b = std::static_pointer_cast<FaultsAndWarnings>(response);
+
+            if (a->fault_code != b->fault_code) {
+                std::ostringstream message;
+                if (b->fault_code)
+                    message << "fault " << b->fault_code << " raised (" << fault_description(b->fault_code) << ")";
+                else
+                    message << "fault " << a->fault_code << " cleared";
+                push(events, "fault", "fault_code", std::to_string(a->fault_code), std::to_string(b->fault_code), message.str());
+            }
+
+            for (const auto& f: warning_fields) {
+                bool from = (*a).*f.second, to = (*b).*f.second;
+                if (from != to)
+                    push(events, "warning", f.first, std::to_string(from), std::to_string(to),
+                         std::string(f.first) + (to ? " raised" : " cleared"));
+            }
+            break;
+        }
+
+        case p18::CommandType::GetWorkingMode: {
+            auto a = std::static_pointer_cast<WorkingMode>(prev);
+            auto b = std::static_pointer_cast<WorkingMode>(response);
+
+            if (a->mode != b->mode) {
+                std::string from = formatter::to_str(a->mode), to = formatter::to_str(b->mode);
+                push(events, "mode", "mode", from, to, "mode " + from + " -> " + to);
+            }
+            break;
+        }
+
+        case p18::CommandType::GetFlagsAndStatuses: {
+            auto a = std::static_pointer_cast<FlagsAndStatuses>(prev);
+            auto b = std::static_pointer_cast<FlagsAndStatuses>(response);
+
+            for (const auto& f: flag_fields) {
+                bool from = (*a).*f.second, to = (*b).*f.second;
+                if (from != to)
+                    push(events, "flag", f.first, std::to_string(from), std::to_string(to),
+                         std::string(f.first) + (to ? " enabled" : " disabled"));
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    if (events.empty())
+        return;
+
+    u64 time = voltronic::unix_timestamp();
+    for (auto& e: events) {
+        e.id = nextId_++;
+        e.time = time;
+        events_.push_back(std::move(e));
+    }
+    while (events_.size() > MAX_EVENTS)
+        events_.pop_front();
+
+    lock.unlock();
+    cv_.notify_all();
+}
+
+u64 EventLog::lastId() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return nextId_ - 1;
+}
+
+std::vector<Event> EventLog::wait(u64& lastId, u64 timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, std::chrono::milliseconds(timeout), [this, lastId]() { return nextId_ - 1 > lastId; });
+
+    std::vector<Event> events;
+    for (const auto& e: events_) {
+        if (e.id > lastId)
+            events.push_back(e);
+    }
+    lastId = nextId_ - 1;
+    return events;
+}
+
+
+/**
+ * Formatting
+ */
+
+std::ostream& EventsList::writeTable(std::ostream& os) const {
+    for (const auto& e: events_) {
+        os << e.time << " " << e.message;
+        if (&e != &events_.back())
+            os << std::endl;
+    }
+    return os;
+}
+
+std::ostream& EventsList::writeSimpleTable(std::ostream& os) const {
+    auto quoted = [](std::string s) {
+        return string_has(s, ' ') ? "\"" + s + "\"" : s;
+    };
+    for (const auto& e: events_) {
+        os << e.id << " " << e.time << " " << e.type << " " << e.key << " " << quoted(e.from) << " " << quoted(e.to);
+        if (&e != &events_.back())
+            os << std::endl;
+    }
+    return os;
+}
+
+std::ostream& EventsList::writeJSON(std::ostream& os) const {
+    formatter::ordered_json data = formatter::ordered_json::array();
+    for (const auto& e: events_) {
+        data.push_back({
+            {"id", e.id},
+            {"time", e.time},
+            {"type", e.type},
+            {"key", e.key},
+            {"from", e.from},
+            {"to", e.to},
+            {"message", e.message}
+        });
+    }
+
+    formatter::ordered_json j = {
+        {"result", "ok"},
+        {"data", data}
+    };
+    return os << j.dump();
+}
+
+std::ostream& EventsList::writeSimpleJSON(std::ostream& os) const {
+    return writeJSON(os);
+}
+
+}
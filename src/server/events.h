@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef INVERTER_TOOLS_SERVER_EVENTS_H
+#define INVERTER_TOOLS_SERVER_EVENTS_H
+
+#include <array>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+
+#include "../numeric_types.h"
+#include "../formatter/formatter.h"
+#include "../p18/types.h"
+#include "../p18/response.h"
+
+namespace server {
+
+struct Event {
+    u64 id;
+    u64 time;             /* ms since epoch */
+    std::string type;     /* fault, warning, mode or flag */
+    std::string key;      /* name of the field that has changed */
+    std::string from;
+    std::string to;
+    std::string message;
+};
+
+
+/**
+ * Compares successive responses to the commands alerting consumers care about
+ * and keeps a short history of what has changed, for subscribers to pick up.
+ */
+class EventLog {
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::array<std::shared_ptr<p18::response_type::BaseResponse>, 3> last_;
+    std::deque<Event> events_;
+    u64 nextId_;
+
+    void push(std::vector<Event>& events, const char* type, std::string key, std::string from, std::string to, std::string message);
+
+public:
+    static const size_t MAX_EVENTS = 256;
+
+    EventLog();
+
+    static bool isWatched(p18::CommandType commandType);
+
+    void update(p18::CommandType commandType, const std::shared_ptr<p18::response_type::BaseResponse>& response);
+
+    // id of the latest event, or 0 if there were none yet
+    u64 lastId();
+
+    // waits up to `timeout` ms for events newer than `lastId` and updates it
+    std::vector<Event> wait(u64& lastId, u64 timeout);
+};
+
+
+class EventsList : public formatter::Formattable {
+private:
+    std::vector<Event> events_;
+
+public:
+    EventsList(formatter::Format format, std::vector<Event> events)
+        : formatter::Formattable(format), events_(std::move(events)) {}
+
+    std::ostream& writeTable(std::ostream& os) const override;
+    std::ostream& writeSimpleTable(std::ostream& os) const override;
+    std::ostream& writeJSON(std::ostream& os) const override;
+    std::ostream& writeSimpleJSON(std::ostream& os) const override;
+};
+
+}
+
+#endif //INVERTER_TOOLS_SERVER_EVENTS_H
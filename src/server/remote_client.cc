@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "remote_client.h"
+#include "../common.h"
+
+namespace server {
+
+RemoteClient::RemoteClient() : sock_(-1) {}
+
+RemoteClient::~RemoteClient() {
+    if (sock_ != -1) {
+        // EOT, let the server close the connection gracefully
+        char eot = '\4';
+        ::send(sock_, &eot, 1, MSG_NOSIGNAL);
+        close(sock_);
+    }
+}
+
+static void set_timeout(int sock, u64 timeout) {
+    struct timeval tv = {0};
+    tv.tv_sec = static_cast<time_t>(timeout / 1000);
+    tv.tv_usec = static_cast<suseconds_t>((timeout % 1000) * 1000);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+void RemoteClient::connect(const std::string& address, u64 timeout) {
+    if (address.find('/') != std::string::npos) {
+        struct sockaddr_un addr = {0};
+        if (address.size() >= sizeof(addr.sun_path))
+            throw RemoteError("unix socket path is too long");
+
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+
+        sock_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock_ == -1)
+            throw RemoteError("socket: " + std::string(strerror(errno)));
+
+        set_timeout(sock_, timeout);
+        if (::connect(sock_, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+            throw RemoteError(address + ": " + std::string(strerror(errno)));
+        return;
+    }
+
+    std::string host = address;
+    std::string port = std::to_string(DEFAULT_PORT);
+
+    if (!address.empty() && address[0] == '[') {
+        size_t end = address.find(']');
+        if (end == std::string::npos)
+            throw RemoteError("invalid address: " + address);
+        host = address.substr(1, end - 1);
+        if (end + 1 < address.size()) {
+            if (address[end + 1] != ':')
+                throw RemoteError("invalid address: " + address);
+            port = address.substr(end + 2);
+        }
+    } else if (std::count(address.begin(), address.end(), ':') == 1) {
+        size_t colon = address.find(':');
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    struct addrinfo* res = nullptr;
+    int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0)
+        throw RemoteError(address + ": " + std::string(gai_strerror(err)));
+
+    std::string error;
+    for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+        int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock == -1) {
+            error = strerror(errno);
+            continue;
+        }
+
+        set_timeout(sock, timeout);
+        if (::connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+            sock_ = sock;
+            break;
+        }
+
+        error = strerror(errno);
+        close(sock);
+    }
+    freeaddrinfo(res);
+
+    if (sock_ == -1)
+        throw RemoteError(address + ": " + error);
+}
+
+void RemoteClient::send(const std::string& line) {
+    std::string buf = line + "\r\n";
+    const char* ptr = buf.c_str();
+    size_t left = buf.size();
+
+    while (left > 0) {
+        ssize_t sent = ::send(sock_, ptr, left, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            throw RemoteError("send: " + std::string(strerror(errno)));
+        }
+        left -= sent;
+        ptr += sent;
+    }
+}
+
+RemoteResponse RemoteClient::receive() {
+    static const std::string terminator = "\r\n\r\n";
+
+    size_t end;
+    while ((end = buf_.find(terminator)) == std::string::npos) {
+        char chunk[2048];
+        ssize_t rcvd = recv(sock_, chunk, sizeof(chunk), 0);
+        if (rcvd == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                throw RemoteError("recv: timed out");
+            throw RemoteError("recv: " + std::string(strerror(errno)));
+        }
+        if (rcvd == 0)
+            throw RemoteError("connection closed by server");
+        buf_.append(chunk, rcvd);
+    }
+
+    std::string response = buf_.substr(0, end);
+    buf_.erase(0, end + terminator.size());
+
+    RemoteResponse resp;
+    size_t eol = response.find("\r\n");
+    std::string status = response.substr(0, eol);
+    if (status == "ok")
+        resp.ok = true;
+    else if (status == "err")
+        resp.ok = false;
+    else
+        throw RemoteError("invalid response status: " + status);
+
+    if (eol != std::string::npos)
+        resp.body = response.substr(eol + 2);
+
+    return resp;
+}
+
+RemoteResponse RemoteClient::request(const std::string& line) {
+    send(line);
+    return receive();
+}
+
+void RemoteClient::setOption(const std::string& line) {
+    auto resp = request(line);
+    if (!resp.ok)
+        throw RemoteError(line + ": " + resp.body);
+}
+
+RemoteResponse RemoteClient::execute(const std::vector<std::string>& input) {
+    std::string line = "exec";
+    for (const auto& s: input)
+        line += " " + s;
+    return request(line);
+}
+
+}
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef INVERTER_TOOLS_SERVER_REMOTE_CLIENT_H
+#define INVERTER_TOOLS_SERVER_REMOTE_CLIENT_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "../numeric_types.h"
+
+namespace server {
+
+struct RemoteResponse {
+    bool ok;
+    std::string body;
+};
+
+
+/**
+ * Client side of the inverterd protocol, see PROTOCOL.md.
+ */
+class RemoteClient {
+private:
+    int sock_;
+    std::string buf_;
+
+    void send(const std::string& line);
+    RemoteResponse receive();
+
+public:
+    // inverterd itself may wait for the device for up to --queue-timeout
+    static const u64 TIMEOUT = 15000;
+
+    RemoteClient();
+    ~RemoteClient();
+
+    // HOST:PORT, [IPV6]:PORT, HOST (default port) or path to a unix socket
+    void connect(const std::string& address, u64 timeout);
+
+    RemoteResponse request(const std::string& line);
+
+    // sends a command, throws RemoteError if the server doesn't accept it
+    void setOption(const std::string& line);
+
+    RemoteResponse execute(const std::vector<std::string>& input);
+};
+
+
+class RemoteError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+}
+
+#endif //INVERTER_TOOLS_SERVER_REMOTE_CLIENT_H
@@ -6,14 +6,24 @@
 #include <algorithm>
 #include <memory>
 #include <utility>
+#include <limits>
+#include <sstream>
+#include <iomanip>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <netdb.h>
 #include <unistd.h>
 
 #include "../voltronic/exceptions.h"
 #include "../p18/exceptions.h"
 #include "../voltronic/time.h"
+#include "../p18/commands.h"
+#include "../p18/response.h"
 #include "../logging.h"
+#include "../state.h"
 //#include "hexdump/hexdump.h"
 #include "server.h"
 #include "connection.h"
@@ -21,16 +31,34 @@
 
 namespace server {
 
+// how long, in ms, a rejected connection may be drained before it's closed
+static const u64 REJECT_DRAIN_TIMEOUT = 1000;
+
+// how many rejected connections may be drained at once, the rest are closed
+// right away
+static const size_t REJECT_DRAIN_MAX = 256;
+
 Server::Server(std::shared_ptr<voltronic::Device> device)
-    : sock_(0)
-    , port_(0)
+    : port_(0)
+    , unixSocketBound_(false)
+    , verbose_(false)
+    , device_(std::move(device))
     , cacheTimeout_(CACHE_TIMEOUT)
+    , factsCacheTimeout_(FACTS_CACHE_TIMEOUT)
     , delay_(DELAY)
+    , queueTimeout_(QUEUE_TIMEOUT)
     , endExecutionTime_(0)
     , deviceErrorLimit_(DEVICE_ERROR_LIMIT)
     , deviceErrorCounter_(0)
-    , verbose_(false)
-    , device_(std::move(device)) {
+    , staleWhileRevalidate_(false)
+    , maxStale_(MAX_STALE)
+    , shmInterval_(0)
+    , eventsInterval_(0)
+    , statsInterval_(STATS_INTERVAL)
+    , maxConnections_(MAX_CONNECTIONS)
+    , listenBacklog_(LISTEN_BACKLOG)
+    , connectionRateLimit_(0)
+    , ipRateLimit_(0) {
     client_.setDevice(device_);
 }
 
@@ -43,6 +71,19 @@ void Server::setCacheTimeout(u64 timeout) {
     cacheTimeout_ = timeout;
 }
 
+void Server::setFactsCacheTimeout(u64 timeout) {
+    factsCacheTimeout_ = timeout;
+}
+
+u64 Server::getCacheTimeout(p18::CommandType commandType) const {
+    return is_fact_command(commandType) ? factsCacheTimeout_ : cacheTimeout_;
+}
+
+void Server::setStateDir(const std::string& stateDir, const std::string& deviceId) {
+    stateDir_ = stateDir;
+    deviceId_ = deviceId;
+}
+
 void Server::setDelay(u64 delay) {
     delay_ = delay;
 }
@@ -51,88 +92,562 @@ void Server::setDeviceErrorLimit(u32 deviceErrorLimit) {
     deviceErrorLimit_ = deviceErrorLimit;
 }
 
+void Server::setStatsInterval(u64 interval) {
+    statsInterval_ = interval;
+}
+
+void Server::setStaleWhileRevalidate(bool enabled) {
+    staleWhileRevalidate_ = enabled;
+}
+
+void Server::setMaxStale(u64 maxStale) {
+    maxStale_ = maxStale;
+}
+
+void Server::setMaxConnections(size_t maxConnections) {
+    maxConnections_ = maxConnections;
+}
+
+void Server::setListenBacklog(int backlog) {
+    listenBacklog_ = backlog;
+}
+
+void Server::setConnectionRateLimit(double rate) {
+    connectionRateLimit_ = rate;
+}
+
+void Server::setIpRateLimit(double rate) {
+    ipRateLimit_ = rate;
+}
+
+void Server::setQueueDepth(size_t depth) {
+    deviceQueue_.setMaxDepth(depth);
+}
+
+void Server::setQueueTimeout(u64 timeout) {
+    queueTimeout_ = timeout;
+}
+
 Server::~Server() {
-    if (sock_ > 0)
-        close(sock_);
+    for (int sock: listeners_)
+        close(sock);
+
+    if (!unixSocketPath_.empty() && unixSocketBound_)
+        unlink(unixSocketPath_.c_str());
+}
+
+void Server::setSharedMemory(const std::string& name, u64 interval) {
+    shmName_ = name;
+    shmInterval_ = interval;
+}
+
+void Server::setEventsInterval(u64 interval) {
+    eventsInterval_ = interval;
+}
+
+void Server::setAccessLog(const std::string& path) {
+    accessLogPath_ = path;
+}
+
+void Server::setUnixSocket(const std::string& path) {
+    unixSocketPath_ = path;
 }
 
-void Server::start(std::string& host, int port) {
-    host_ = host;
+void Server::setControlUids(const std::vector<uid_t>& uids) {
+    controlUids_ = uids;
+}
+
+bool Server::isControlAllowed(const Connection& conn) const {
+    if (controlUids_.empty())
+        return true;
+
+    uid_t uid;
+    if (!conn.getPeerUid(uid))
+        return false;
+
+    return std::find(controlUids_.begin(), controlUids_.end(), uid) != controlUids_.end();
+}
+
+void Server::start(const std::vector<std::string>& hosts, int port) {
+    hosts_ = hosts;
     port_ = port;
 
-    sock_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_ == -1)
-        throw ServerError("failed to create socket");
+    loadFacts();
 
-    struct linger sl = {0};
-    sl.l_onoff = 1;
-    sl.l_linger = 0;
-    if (setsockopt(sock_, SOL_SOCKET, SO_LINGER, &sl, sizeof(sl)) == -1)
-        throw ServerError("setsockopt(linger): " + std::string(strerror(errno)));
+    if (port_)
+        listenTcp();
 
-    int flag = 1;
-    if (setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) == -1)
-        throw ServerError("setsockopt(reuseaddr): " + std::string(strerror(errno)));
+    if (!unixSocketPath_.empty())
+        listenUnix();
 
-    struct sockaddr_in serv_addr = {0};
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = inet_addr(host_.c_str());
-    serv_addr.sin_port = htons(port_);
-    memset(serv_addr.sin_zero, 0, sizeof(serv_addr.sin_zero));
+    if (listeners_.empty())
+        throw ServerError("nothing to listen on");
 
-    if (bind(sock_, (struct sockaddr*)&serv_addr, sizeof(serv_addr)))
-        throw ServerError("bind: " + std::string(strerror(errno)));
+    if (!accessLogPath_.empty())
+        accessLog_ = std::make_unique<AccessLog>(accessLogPath_);
 
-    if (listen(sock_, 50))
-        throw ServerError("start: " + std::string(strerror(errno)));
+    if (!shmName_.empty()) {
+        shm_ = std::make_unique<ShmPublisher>(shmName_);
+        if (shmInterval_) {
+            pollers_.emplace_back(&Server::pollLoop, this, std::vector<p18::CommandType> {
+                p18::CommandType::GetGeneralStatus,
+                p18::CommandType::GetFaultsAndWarnings,
+                p18::CommandType::GetFlagsAndStatuses,
+            }, shmInterval_);
+        }
+    }
+
+    if (eventsInterval_) {
+        pollers_.emplace_back(&Server::pollLoop, this, std::vector<p18::CommandType> {
+            p18::CommandType::GetFaultsAndWarnings,
+            p18::CommandType::GetWorkingMode,
+            p18::CommandType::GetFlagsAndStatuses,
+        }, eventsInterval_);
+    }
+
+    if (statsInterval_)
+        statsThread_ = std::thread(&Server::dumpStatsLoop, this);
 
+    if (verbose_)
+        mylog << "waiting for clients..";
+
+    std::vector<struct pollfd> fds;
     while (!shutdownCaught) {
-        struct sockaddr_in addr = {0};
-        socklen_t addr_size = sizeof(addr);
+        // listeners first, then rejected connections in the order of rejected_
+        fds.clear();
+        for (int sock: listeners_)
+            fds.push_back({sock, POLLIN, 0});
+        for (const auto& rejected: rejected_)
+            fds.push_back({rejected.sock, POLLIN, 0});
+
+        // wake up now and then to check shutdownCaught, the signal might have
+        // been delivered to another thread
+        u64 timeout = 1000;
+        if (!rejected_.empty()) {
+            u64 now = voltronic::timestamp();
+            u64 deadline = rejected_.front().deadline;
+            timeout = deadline > now ? std::min(timeout, deadline - now) : 0;
+        }
 
-        if (verbose_)
-            mylog << "waiting for client..";
+        int n = poll(fds.data(), fds.size(), static_cast<int>(timeout));
+        if (n < 0)
+            continue;
+
+        drainRejected(fds.data() + listeners_.size());
+
+        for (size_t i = 0; i < listeners_.size(); i++) {
+            if (fds[i].revents & POLLIN)
+                acceptConnection(fds[i].fd);
+        }
+    }
+
+    for (const auto& rejected: rejected_)
+        close(rejected.sock);
+    rejected_.clear();
+
+    if (statsThread_.joinable())
+        statsThread_.join();
+
+    for (auto& poller: pollers_)
+        poller.join();
 
-        int sock = accept(sock_, (struct sockaddr*)&addr, &addr_size);
+    // shutdownCaught is set, so revalidate() won't start any new ones
+    LockGuard lock(threads_mutex_);
+    for (auto& revalidator: revalidators_) {
+        if (revalidator.joinable())
+            revalidator.join();
+    }
+}
+
+void Server::listenTcp() {
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+    std::string port = std::to_string(port_);
+    std::vector<struct sockaddr_storage> addrs;
+    std::vector<socklen_t> addrLens;
+    bool hasIPv4 = false;
+
+    for (const auto& host: hosts_) {
+        struct addrinfo* result = nullptr;
+        int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+        if (error != 0)
+            throw ServerError("getaddrinfo(" + host + "): " + std::string(gai_strerror(error)));
+
+        for (struct addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+            struct sockaddr_storage addr = {0};
+            memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+            addrs.push_back(addr);
+            addrLens.push_back(ai->ai_addrlen);
+            if (ai->ai_family == AF_INET)
+                hasIPv4 = true;
+        }
+
+        freeaddrinfo(result);
+    }
+
+    for (size_t i = 0; i < addrs.size(); i++) {
+        int family = addrs[i].ss_family;
+
+        int sock = socket(family, SOCK_STREAM, 0);
         if (sock == -1)
+            throw ServerError("failed to create socket: " + std::string(strerror(errno)));
+        listeners_.push_back(sock);
+
+        struct linger sl = {0};
+        sl.l_onoff = 1;
+        sl.l_linger = 0;
+        if (setsockopt(sock, SOL_SOCKET, SO_LINGER, &sl, sizeof(sl)) == -1)
+            throw ServerError("setsockopt(linger): " + std::string(strerror(errno)));
+
+        int flag = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) == -1)
+            throw ServerError("setsockopt(reuseaddr): " + std::string(strerror(errno)));
+
+        // an IPv6 socket accepts IPv4 connections too, unless told otherwise;
+        // it has to be told so if there's a separate IPv4 listener, or they'll clash
+        if (family == AF_INET6) {
+            int v6only = hasIPv4 ? 1 : 0;
+            if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == -1)
+                throw ServerError("setsockopt(v6only): " + std::string(strerror(errno)));
+        }
+
+        if (bind(sock, (struct sockaddr*)&addrs[i], addrLens[i]))
+            throw ServerError("bind(" + format_address(addrs[i]) + "): " + std::string(strerror(errno)));
+
+        if (listen(sock, listenBacklog_))
+            throw ServerError("start: " + std::string(strerror(errno)));
+
+        if (verbose_)
+            mylog << "listening on " << format_address(addrs[i]);
+    }
+}
+
+void Server::listenUnix() {
+    struct sockaddr_un addr = {0};
+    if (unixSocketPath_.size() >= sizeof(addr.sun_path))
+        throw ServerError("unix socket path is too long");
+
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, unixSocketPath_.c_str(), sizeof(addr.sun_path) - 1);
+
+    // a stale socket might be left there if we weren't shut down properly
+    struct stat st = {0};
+    if (lstat(unixSocketPath_.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(unixSocketPath_.c_str());
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        throw ServerError("failed to create unix socket");
+    listeners_.push_back(sock);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)))
+        throw ServerError("bind(" + unixSocketPath_ + "): " + std::string(strerror(errno)));
+    unixSocketBound_ = true;
+
+    if (listen(sock, listenBacklog_))
+        throw ServerError("start: " + std::string(strerror(errno)));
+}
+
+void Server::acceptConnection(int listener) {
+    struct sockaddr_storage addr = {0};
+    socklen_t addr_size = sizeof(addr);
+
+    int sock = accept(listener, (struct sockaddr*)&addr, &addr_size);
+    if (sock == -1)
+        return;
+
+    if (maxConnections_ && getConnectionsCount() >= maxConnections_) {
+        rejectConnection(sock, "busy: too many connections");
+        return;
+    }
+
+    auto conn = new Connection(sock, addr, this);
+    addConnection(conn);
+}
+
+/**
+ * Keeps responses to these commands up to date, even if nobody asks for them
+ * over the socket. Cached responses that are fresh enough are not requested
+ * again, so pollers with overlapping commands don't double the device load.
+ */
+void Server::pollLoop(std::vector<p18::CommandType> commands, u64 interval) {
+    while (!shutdownCaught) {
+        u64 started = voltronic::timestamp();
+
+        for (auto commandType: commands) {
+            std::vector<std::string> arguments;
+            RequestContext ctx;
+            ctx.priority = Priority::Background;
+            ctx.deadline = started + interval;
+
+            try {
+                executeCommand(commandType, arguments, ctx);
+            }
+            catch (std::exception& e) {
+                if (verbose_)
+                    myerr << "failed to poll " << p18::command_name(commandType) << ": " << e.what();
+            }
+        }
+
+        while (!shutdownCaught && voltronic::timestamp() - started < interval)
+            usleep(10 * 1000);
+    }
+}
+
+void Server::dumpStatsLoop() {
+    u64 lastDump = voltronic::timestamp();
+
+    while (!shutdownCaught) {
+        usleep(100 * 1000);
+
+        u64 now = voltronic::timestamp();
+        if (now - lastDump < statsInterval_ * 1000)
             continue;
+        lastDump = now;
 
-        auto conn = new Connection(sock, addr, this);
-        addConnection(conn);
+        mylog << "stats:\n" << *(stats_.format(formatter::Format::Table));
     }
 }
 
 void Server::addConnection(Connection *conn) {
     if (verbose_)
-        myerr << "adding " << conn->ipv4();
+        myerr << "adding " << conn->address();
     LockGuard lock(threads_mutex_);
     connections_.emplace_back(conn);
 }
 
 void Server::removeConnection(Connection *conn) {
     if (verbose_)
-        myerr << "removing " << conn->ipv4();
+        myerr << "removing " << conn->address();
     LockGuard lock(threads_mutex_);
     connections_.erase(std::remove(connections_.begin(), connections_.end(), conn), connections_.end());
 }
 
 size_t Server::getConnectionsCount() const {
+    LockGuard lock(threads_mutex_);
     return connections_.size();
 }
 
-std::shared_ptr<p18::response_type::BaseResponse> Server::executeCommand(p18::CommandType commandType, std::vector<std::string>& arguments) {
-    LockGuard lock(client_mutex_);
+void Server::rejectConnection(int sock, const std::string& message) {
+    if (verbose_)
+        myerr << "rejecting connection: " << message;
+
+    Response resp;
+    resp.type = ResponseType::Error;
+    resp.buf << *(p18::response_type::ErrorResponse(message).format(formatter::Format::JSON));
+
+    std::ostringstream buf;
+    buf << resp;
+    std::string s = buf.str();
+
+    send(sock, s.c_str(), s.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    // closing a socket with unread data in it resets the connection, and the
+    // reset may destroy the response before the client reads it. So finish our
+    // side and let the accept loop discard what the client sends until it
+    // closes too, see drainRejected()
+    shutdown(sock, SHUT_WR);
+
+    if (rejected_.size() >= REJECT_DRAIN_MAX) {
+        close(sock);
+        return;
+    }
+
+    rejected_.push_back({sock, voltronic::timestamp() + REJECT_DRAIN_TIMEOUT});
+}
+
+// fds are the results of the last poll() for rejected_, in the same order
+void Server::drainRejected(const struct pollfd* fds) {
+    u64 now = voltronic::timestamp();
+    char discard[512];
+
+    size_t kept = 0;
+    for (size_t i = 0; i < rejected_.size(); i++) {
+        bool done = now >= rejected_[i].deadline;
+        if (!done && fds[i].revents) {
+            ssize_t rcvd = recv(rejected_[i].sock, discard, sizeof(discard), MSG_DONTWAIT);
+            done = rcvd == 0 || (rcvd == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+        }
+
+        if (done)
+            close(rejected_[i].sock);
+        else
+            rejected_[kept++] = rejected_[i];
+    }
+    rejected_.resize(kept);
+}
+
+void Server::checkRateLimit(const RequestContext& ctx) {
+    if (ctx.rateLimit != nullptr && !ctx.rateLimit->take())
+        throw QueueError("busy: connection rate limit exceeded");
+
+    if (!ipRateLimit_ || ctx.clientAddress.empty())
+        return;
+
+    LockGuard lock(ipRateLimits_mutex_);
+
+    // forget about clients that haven't been seen for a while
+    if (ipRateLimits_.size() >= IP_RATE_LIMITS_MAX) {
+        for (auto it = ipRateLimits_.begin(); it != ipRateLimits_.end();) {
+            if (it->second.isIdle())
+                it = ipRateLimits_.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    auto& bucket = ipRateLimits_.try_emplace(ctx.clientAddress, ipRateLimit_, ipRateLimit_).first->second;
+    if (!bucket.take())
+        throw QueueError("busy: rate limit exceeded for " + ctx.clientAddress);
+}
+
+std::shared_ptr<const CachedResponse> Server::getCachedResponse(p18::CommandType commandType, const std::vector<std::string>& arguments, u64 maxAge) const {
+    auto cr = std::atomic_load(&cache_[p18::command_index(commandType)]);
+    if (cr && voltronic::timestamp() - cr->time <= maxAge && arguments == cr->arguments)
+        return cr;
+
+    return nullptr;
+}
+
+// median of what it took before, in ms, or 0 if the command hasn't been run yet
+u64 Server::estimateExecution(p18::CommandType commandType) {
+    u64 us = stats_.get(commandType).stage(Stage::Execute).percentile(50);
+    return (us + 999) / 1000;
+}
+
+std::shared_ptr<const CachedResponse> Server::executeCommand(p18::CommandType commandType, std::vector<std::string>& arguments, RequestContext ctx) {
+    CommandStats& commandStats = stats_.get(commandType);
+    AccessRecord dummy;
+    AccessRecord& access = ctx.access ? *ctx.access : dummy;
+
+    u64 cacheTimeout = getCacheTimeout(commandType);
+
+    auto cr = getCachedResponse(commandType, arguments, cacheTimeout);
+    if (cr) {
+        commandStats.cacheHits++;
+        access.cache = CacheStatus::Hit;
+        if (cr->unconfirmed)
+            revalidate(commandType, arguments);
+        return cr;
+    }
+
+    if (staleWhileRevalidate_ && !p18::is_set_command(commandType)) {
+        cr = getCachedResponse(commandType, arguments,
+                               maxStale_ ? cacheTimeout + maxStale_ : std::numeric_limits<u64>::max());
+        if (cr) {
+            commandStats.cacheHits++;
+            access.cache = CacheStatus::Stale;
+            revalidate(commandType, arguments);
+            return cr;
+        }
+    }
+
+    if (p18::is_set_command(commandType))
+        ctx.priority = Priority::Control;
+    ctx.estimate = estimateExecution(commandType);
+
+    u64 time = voltronic::timestamp_us();
+    try {
+        // set-* commands come from operators and must not be turned away
+        if (!p18::is_set_command(commandType))
+            checkRateLimit(ctx);
 
-    auto it = cache_.find(commandType);
-    if (it != cache_.end()) {
-        auto cr = it->second;
-        if (voltronic::timestamp() - cr.time <= cacheTimeout_ && arguments == cr.arguments) {
-            return cr.response;
+        deviceQueue_.acquire(ctx);
+    }
+    catch (QueueError& e) {
+        access.queueWait = voltronic::timestamp_us() - time;
+
+        // an outdated answer is better than none
+        if (!p18::is_set_command(commandType)) {
+            cr = getCachedResponse(commandType, arguments, std::numeric_limits<u64>::max());
+            if (cr) {
+                if (verbose_)
+                    mylog << e.what() << ", serving cached response";
+                commandStats.cacheHits++;
+                access.cache = CacheStatus::Stale;
+                return cr;
+            }
         }
+        commandStats.errors++;
+        throw;
+    }
+    DeviceQueueLock lock(deviceQueue_, std::adopt_lock);
+    access.queueWait = voltronic::timestamp_us() - time;
+
+    // might have been refreshed while we were waiting in the queue
+    cr = getCachedResponse(commandType, arguments, cacheTimeout);
+    if (cr) {
+        commandStats.cacheHits++;
+        access.cache = CacheStatus::Coalesced;
+        return cr;
+    }
+
+    access.cache = CacheStatus::Miss;
+    cr = execute(commandType, arguments);
+    access.device = client_.getTimings().device;
+    return cr;
+}
 
-        cache_.erase(it);
+/**
+ * Refreshes cached response in background, unless it's already being refreshed.
+ */
+void Server::revalidate(p18::CommandType commandType, const std::vector<std::string>& arguments) {
+    size_t index = p18::command_index(commandType);
+    if (revalidating_[index].exchange(true))
+        return;
+
+    LockGuard threadsLock(threads_mutex_);
+    if (shutdownCaught) {
+        revalidating_[index] = false;
+        return;
     }
 
+    // the previous refresh of this command has already reset revalidating_[index],
+    // that's the last thing it does, so this won't block for long
+    auto& revalidator = revalidators_[index];
+    if (revalidator.joinable())
+        revalidator.join();
+
+    revalidator = std::thread([this, commandType, arguments, index]() {
+        std::vector<std::string> args(arguments);
+        try {
+            RequestContext ctx;
+            ctx.priority = Priority::Background;
+            ctx.estimate = estimateExecution(commandType);
+            DeviceQueueLock lock(deviceQueue_, ctx);
+
+            // facts from the state file might belong to another inverter, check
+            // that first, before relying on them any further
+            if (!persistedSerialNumber_.empty() && commandType != p18::CommandType::GetSerialNumber) {
+                std::vector<std::string> noArgs;
+                auto sn = std::atomic_load(&cache_[p18::command_index(p18::CommandType::GetSerialNumber)]);
+                if (!sn || sn->unconfirmed)
+                    execute(p18::CommandType::GetSerialNumber, noArgs);
+            }
+
+            auto cr = getCachedResponse(commandType, args, getCacheTimeout(commandType));
+            if (!cr || cr->unconfirmed)
+                execute(commandType, args);
+        }
+        catch (std::exception& e) {
+            if (verbose_)
+                myerr << "failed to refresh " << p18::command_name(commandType) << ": " << e.what();
+        }
+        revalidating_[index] = false;
+    });
+}
+
+/**
+ * Runs the command on the device and caches the response.
+ * Must be called with the device queue acquired.
+ */
+std::shared_ptr<const CachedResponse> Server::execute(p18::CommandType commandType, std::vector<std::string>& arguments) {
+    CommandStats& commandStats = stats_.get(commandType);
+    commandStats.cacheMisses++;
+
     if (delay_ != 0 && endExecutionTime_ != 0) {
         u64 now = voltronic::timestamp();
         u64 diff = now - endExecutionTime_;
@@ -144,32 +659,182 @@ std::shared_ptr<p18::response_type::BaseResponse> Server::executeCommand(p18::Co
     try {
         auto response = client_.execute(commandType, arguments);
         endExecutionTime_ = voltronic::timestamp();
-
-        CachedResponse cr {
+        stats_.recordExecution(commandType, client_.getTimings(), client_.getDeviceTimings());
+
+        // most of the time the device answers exactly what it answered last
+        // time; then the cached response object is kept and the new one goes
+        // back to the client to be decoded into again
+        auto& slot = cache_[p18::command_index(commandType)];
+        auto prev = std::atomic_load(&slot);
+        bool changed = !prev
+            || prev->unconfirmed
+            || prev->arguments != arguments
+            || !prev->response->sameRaw(*response);
+        if (!changed)
+            response = prev->response;
+
+        auto cr = std::make_shared<const CachedResponse>(CachedResponse {
             .time = endExecutionTime_,
             .arguments = arguments,
             .response = response
-        };
-        cache_[commandType] = cr;
+        });
+        std::atomic_store(&slot, cr);
+
+        if (changed && is_fact_command(commandType))
+            onFactUpdated(commandType, response);
+
+        if (shm_ && ShmPublisher::isPublished(commandType))
+            shm_->publish(commandType, arguments, response);
+
+        if (changed && EventLog::isWatched(commandType))
+            events_.update(commandType, response);
+
+        // settings are part of the rated information
+        if (p18::is_set_command(commandType)) {
+            std::atomic_store(&cache_[p18::command_index(p18::CommandType::GetRatedInformation)],
+                              std::shared_ptr<const CachedResponse>());
+            saveFacts();
+        }
 
         deviceErrorCounter_ = 0;
-        return response;
+        return cr;
     }
     catch (voltronic::DeviceError& e) {
+        commandStats.errors++;
         deviceErrorCounter_++;
         if (!shutdownCaught && deviceErrorCounter_ >= deviceErrorLimit_)
             shutdownCaught = true;
         throw std::runtime_error("device error: " + std::string(e.what()));
     }
     catch (voltronic::TimeoutError& e) {
+        commandStats.errors++;
         throw std::runtime_error("timeout: " + std::string(e.what()));
     }
     catch (voltronic::InvalidDataError& e) {
+        commandStats.errors++;
         throw std::runtime_error("data is invalid: " + std::string(e.what()));
     }
     catch (p18::InvalidResponseError& e) {
+        commandStats.errors++;
         throw std::runtime_error("response is invalid: " + std::string(e.what()));
     }
 }
 
-}
\ No newline at end of file
+
+/**
+ * Facts persistence
+ */
+
+static std::string hex_encode(const char* data, size_t size) {
+    std::ostringstream buf;
+    buf << std::hex << std::setfill('0');
+    for (size_t i = 0; i < size; i++)
+        buf << std::setw(2) << static_cast<unsigned>(static_cast<u8>(data[i]));
+    return buf.str();
+}
+
+static std::string hex_decode(const std::string& hex) {
+    if (hex.size() % 2 != 0)
+        throw std::invalid_argument("odd length");
+
+    std::string data;
+    for (size_t i = 0; i < hex.size(); i += 2)
+        data += static_cast<char>(std::stoul(hex.substr(i, 2), nullptr, 16));
+    return data;
+}
+
+void Server::loadFacts() {
+    std::string data;
+    if (!state_load(stateDir_, state_file_name("facts-", deviceId_), data))
+        return;
+
+    std::map<p18::CommandType, std::shared_ptr<p18::response_type::BaseResponse>> facts;
+
+    std::istringstream lines(data);
+    std::string name, hex;
+    while (lines >> name >> hex) {
+        try {
+            auto it = p18::client_commands.find(name);
+            if (it == p18::client_commands.end() || !is_fact_command(it->second))
+                throw std::invalid_argument("unexpected command");
+
+            std::string raw = hex_decode(hex);
+            std::shared_ptr<char> buf(new char[raw.size()]);
+            memcpy(buf.get(), raw.data(), raw.size());
+
+            auto response = p18::Client::createResponse(it->second, buf, raw.size());
+            if (!response->validate())
+                throw p18::InvalidResponseError("validate() failed");
+            response->unpack();
+
+            facts[it->second] = response;
+        }
+        catch (std::exception& e) {
+            myerr << "ignoring persisted " << name << ": " << e.what();
+        }
+    }
+
+    auto sn = facts.find(p18::CommandType::GetSerialNumber);
+    if (sn == facts.end()) {
+        myerr << "no serial number in persisted facts, ignoring them";
+        return;
+    }
+    persistedSerialNumber_ = std::static_pointer_cast<p18::response_type::SerialNumber>(sn->second)->id;
+
+    u64 now = voltronic::timestamp();
+    for (auto& fact: facts) {
+        auto cr = std::make_shared<const CachedResponse>(CachedResponse {
+            .time = now,
+            .arguments = {},
+            .response = fact.second,
+            .unconfirmed = true
+        });
+        std::atomic_store(&cache_[p18::command_index(fact.first)], cr);
+    }
+
+    if (verbose_)
+        mylog << "loaded " << facts.size() << " persisted facts of " << persistedSerialNumber_;
+}
+
+void Server::saveFacts() {
+    if (stateDir_.empty())
+        return;
+
+    std::ostringstream buf;
+    for (const auto& item: p18::client_commands) {
+        if (!is_fact_command(item.second))
+            continue;
+
+        auto cr = std::atomic_load(&cache_[p18::command_index(item.second)]);
+        if (!cr)
+            continue;
+
+        const auto& response = cr->response;
+        buf << item.first << " " << hex_encode(response->getRaw(), response->getRawSize()) << "\n";
+    }
+
+    state_save(stateDir_, state_file_name("facts-", deviceId_), buf.str());
+}
+
+void Server::onFactUpdated(p18::CommandType commandType, const std::shared_ptr<p18::response_type::BaseResponse>& response) {
+    if (commandType == p18::CommandType::GetSerialNumber && !persistedSerialNumber_.empty()) {
+        const std::string& id = std::static_pointer_cast<p18::response_type::SerialNumber>(response)->id;
+        if (id != persistedSerialNumber_) {
+            mylog << "serial number changed (" << persistedSerialNumber_ << " -> " << id << "), dropping persisted facts";
+            for (const auto& item: p18::client_commands) {
+                if (!is_fact_command(item.second))
+                    continue;
+
+                auto& slot = cache_[p18::command_index(item.second)];
+                auto cr = std::atomic_load(&slot);
+                if (cr && cr->unconfirmed)
+                    std::atomic_store(&slot, std::shared_ptr<const CachedResponse>());
+            }
+        }
+        persistedSerialNumber_.clear();
+    }
+
+    saveFacts();
+}
+
+}
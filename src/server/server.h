@@ -4,6 +4,7 @@
 #define INVERTER_TOOLS_SERVER_TCP_SERVER_H
 
 #include <memory>
+#include <array>
 #include <string>
 #include <vector>
 #include <thread>
@@ -11,12 +12,20 @@
 #include <csignal>
 #include <atomic>
 #include <netinet/in.h>
+#include <sys/types.h>
 
 #include "connection.h"
+#include "stats.h"
+#include "device_queue.h"
+#include "token_bucket.h"
+#include "shm_publisher.h"
+#include "access_log.h"
+#include "events.h"
 #include "../numeric_types.h"
 #include "../formatter/formatter.h"
 #include "../p18/client.h"
 #include "../p18/types.h"
+#include "../p18/functions.h"
 #include "../voltronic/device.h"
 #include "../voltronic/time.h"
 
@@ -30,33 +39,106 @@ struct CachedResponse {
     u64 time;
     std::vector<std::string> arguments;
     std::shared_ptr<p18::response_type::BaseResponse> response;
+
+    // loaded from the state file, not confirmed by the device yet
+    bool unconfirmed = false;
 };
 
+// responses to these commands are not expected to ever change, so they are
+// cached for much longer and kept between restarts
+constexpr bool is_fact_command(p18::CommandType commandType) {
+    switch (commandType) {
+        case p18::CommandType::GetProtocolID:
+        case p18::CommandType::GetSerialNumber:
+        case p18::CommandType::GetCPUVersion:
+        case p18::CommandType::GetRatedInformation:
+        case p18::CommandType::GetRatedDefaults:
+            return true;
+        default:
+            return false;
+    }
+}
+
 class Server {
 private:
-    int sock_;
-    std::string host_;
+    std::vector<int> listeners_;
+    std::vector<std::string> hosts_;
     int port_;
+    std::string unixSocketPath_;
+    bool unixSocketBound_;
+    std::vector<uid_t> controlUids_;
     bool verbose_;
     p18::Client client_;
     std::shared_ptr<voltronic::Device> device_;
 
     u64 cacheTimeout_;
+    u64 factsCacheTimeout_;
     u64 delay_;
+    u64 queueTimeout_;
     u64 endExecutionTime_;
     u32 deviceErrorLimit_;
     u32 deviceErrorCounter_;
-    std::map<p18::CommandType, CachedResponse> cache_;
 
-    std::mutex threads_mutex_;
-    std::mutex client_mutex_;
+    // latest response of each command, indexed by p18::command_index();
+    // published with std::atomic_store(), so that cache hits never have
+    // to wait for the device queue
+    std::array<std::shared_ptr<const CachedResponse>, p18::COMMANDS_COUNT> cache_;
+    std::array<std::atomic<bool>, p18::COMMANDS_COUNT> revalidating_{};
+    std::array<std::thread, p18::COMMANDS_COUNT> revalidators_; /* guarded by threads_mutex_ */
+    bool staleWhileRevalidate_;
+    u64 maxStale_;
+
+    std::string stateDir_;
+    std::string deviceId_;
+    std::string persistedSerialNumber_;
+
+    std::string shmName_;
+    u64 shmInterval_;
+    std::unique_ptr<ShmPublisher> shm_;
+
+    EventLog events_;
+    u64 eventsInterval_;
+
+    std::string accessLogPath_;
+    std::unique_ptr<AccessLog> accessLog_;
+
+    // background threads that keep some of the responses fresh
+    std::vector<std::thread> pollers_;
+
+    Stats stats_;
+    u64 statsInterval_;
+    std::thread statsThread_;
+
+    mutable std::mutex threads_mutex_;
+    DeviceQueue deviceQueue_;
+
+    size_t maxConnections_;
+    // rejected connections, drained by the accept loop until the client closes
+    // them or the deadline (ms) passes; ordered by deadline
+    struct RejectedConnection {
+        int sock;
+        u64 deadline;
+    };
+    std::vector<RejectedConnection> rejected_;
+    int listenBacklog_;
+    double connectionRateLimit_;
+    double ipRateLimit_;
+    std::mutex ipRateLimits_mutex_;
+    std::map<std::string, TokenBucket> ipRateLimits_;
 
     std::vector<Connection*> connections_;
 
 public:
     static const u64 CACHE_TIMEOUT = 1000;
+    static const u64 FACTS_CACHE_TIMEOUT = 3600000;
     static const u32 DEVICE_ERROR_LIMIT = 10;
     static const u64 DELAY = 0;
+    static const u64 STATS_INTERVAL = 0;
+    static const u64 QUEUE_TIMEOUT = 10000;
+    static const u64 MAX_STALE = 0;
+    static const size_t MAX_CONNECTIONS = 64;
+    static const int LISTEN_BACKLOG = 50;
+    static const size_t IP_RATE_LIMITS_MAX = 1024;
 
     volatile std::atomic<bool> sigCaught = 0;
 
@@ -65,17 +147,57 @@ public:
 
     void setVerbose(bool verbose);
     void setCacheTimeout(u64 timeout);
+    void setFactsCacheTimeout(u64 timeout);
+    void setStateDir(const std::string& stateDir, const std::string& deviceId);
     void setDelay(u64 delay);
     void setDeviceErrorLimit(u32 deviceErrorLimit);
-
-    void start(std::string& host, int port);
+    void setStatsInterval(u64 interval);
+    void setStaleWhileRevalidate(bool enabled);
+    void setMaxStale(u64 maxStale);
+    void setQueueDepth(size_t depth);
+    void setSharedMemory(const std::string& name, u64 interval);
+    void setEventsInterval(u64 interval);
+    void setAccessLog(const std::string& path);
+    void setUnixSocket(const std::string& path);
+    void setControlUids(const std::vector<uid_t>& uids);
+    void setMaxConnections(size_t maxConnections);
+    void setListenBacklog(int backlog);
+    void setConnectionRateLimit(double rate);
+    void setIpRateLimit(double rate);
+    double getConnectionRateLimit() const { return connectionRateLimit_; }
+    void setQueueTimeout(u64 timeout);
+    u64 getQueueTimeout() const { return queueTimeout_; }
+    u64 getCacheTimeout(p18::CommandType commandType) const;
+
+    void start(const std::vector<std::string>& hosts, int port);
 
     bool verbose() const { return verbose_; }
     void addConnection(Connection* conn);
     void removeConnection(Connection* conn);
     size_t getConnectionsCount() const;
+    bool isControlAllowed(const Connection& conn) const;
+    Stats& stats() { return stats_; }
+    EventLog& events() { return events_; }
+    AccessLog* accessLog() { return accessLog_.get(); }
+
+    std::shared_ptr<const CachedResponse> executeCommand(p18::CommandType commandType, std::vector<std::string>& arguments, RequestContext ctx);
 
-    std::shared_ptr<p18::response_type::BaseResponse> executeCommand(p18::CommandType commandType, std::vector<std::string>& arguments);
+private:
+    std::shared_ptr<const CachedResponse> getCachedResponse(p18::CommandType commandType, const std::vector<std::string>& arguments, u64 maxAge) const;
+    std::shared_ptr<const CachedResponse> execute(p18::CommandType commandType, std::vector<std::string>& arguments);
+    void revalidate(p18::CommandType commandType, const std::vector<std::string>& arguments);
+    u64 estimateExecution(p18::CommandType commandType);
+    void checkRateLimit(const RequestContext& ctx);
+    void listenTcp();
+    void listenUnix();
+    void acceptConnection(int listener);
+    void rejectConnection(int sock, const std::string& message);
+    void drainRejected(const struct pollfd* fds);
+    void loadFacts();
+    void saveFacts();
+    void onFactUpdated(p18::CommandType commandType, const std::shared_ptr<p18::response_type::BaseResponse>& response);
+    void dumpStatsLoop();
+    void pollLoop(std::vector<p18::CommandType> commands, u64 interval);
 };
 
 
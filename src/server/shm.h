@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef INVERTER_TOOLS_SERVER_SHM_H
+#define INVERTER_TOOLS_SERVER_SHM_H
+
+// Layout of the shared memory segment inverterd publishes latest responses to
+// (--shm-name). This header is self-contained, so that readers can use it
+// without the rest of the sources.
+//
+// Every section is protected by a seqlock: the writer makes `sequence` odd,
+// updates the section and makes it even again. Readers copy the section and
+// retry if `sequence` was odd or has changed meanwhile, see shm_read().
+//
+// All values are in units of the p18 protocol (see p18/response.h), enums are
+// stored as their numeric values, booleans as 0 or 1.
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+namespace server::shm {
+
+const uint32_t MAGIC = 0x50313853; /* "S81P" on little-endian */
+const uint32_t VERSION = 1;
+
+struct GeneralStatus {
+    uint32_t grid_voltage;              /* unit: 0.1V */
+    uint32_t grid_freq;                 /* unit: 0.1Hz */
+    uint32_t ac_output_voltage;         /* unit: 0.1V */
+    uint32_t ac_output_freq;            /* unit: 0.1Hz */
+    uint32_t ac_output_apparent_power;  /* unit: VA */
+    uint32_t ac_output_active_power;    /* unit: W */
+    uint32_t output_load_percent;       /* unit: % */
+    uint32_t battery_voltage;           /* unit: 0.1V */
+    uint32_t battery_voltage_scc;       /* unit: 0.1V */
+    uint32_t battery_voltage_scc2;      /* unit: 0.1V */
+    uint32_t battery_discharge_current; /* unit: A */
+    uint32_t battery_charge_current;    /* unit: A */
+    uint32_t battery_capacity;          /* unit: % */
+    uint32_t inverter_heat_sink_temp;   /* unit: C */
+    uint32_t mppt1_charger_temp;        /* unit: C */
+    uint32_t mppt2_charger_temp;        /* unit: C */
+    uint32_t pv1_input_power;           /* unit: W */
+    uint32_t pv2_input_power;           /* unit: W */
+    uint32_t pv1_input_voltage;         /* unit: 0.1V */
+    uint32_t pv2_input_voltage;         /* unit: 0.1V */
+    uint32_t configuration_status;
+    uint32_t mppt1_charger_status;
+    uint32_t mppt2_charger_status;
+    uint32_t load_connected;
+    uint32_t battery_power_direction;
+    uint32_t dc_ac_power_direction;
+    uint32_t line_power_direction;
+    uint32_t local_parallel_id;
+};
+
+struct ParallelGeneralStatus {
+    uint32_t id;                             /* parallel machine id it was requested for */
+    uint32_t parallel_connection_status;
+    uint32_t work_mode;
+    uint32_t fault_code;
+    uint32_t grid_voltage;                   /* unit: 0.1V */
+    uint32_t grid_freq;                      /* unit: 0.1Hz */
+    uint32_t ac_output_voltage;              /* unit: 0.1V */
+    uint32_t ac_output_freq;                 /* unit: 0.1Hz */
+    uint32_t ac_output_apparent_power;       /* unit: VA */
+    uint32_t ac_output_active_power;         /* unit: W */
+    uint32_t total_ac_output_apparent_power; /* unit: VA */
+    uint32_t total_ac_output_active_power;   /* unit: W */
+    uint32_t output_load_percent;            /* unit: % */
+    uint32_t total_output_load_percent;      /* unit: % */
+    uint32_t battery_voltage;                /* unit: 0.1V */
+    uint32_t battery_discharge_current;      /* unit: A */
+    uint32_t battery_charge_current;         /* unit: A */
+    uint32_t total_battery_charge_current;   /* unit: A */
+    uint32_t battery_capacity;               /* unit: % */
+    uint32_t pv1_input_power;                /* unit: W */
+    uint32_t pv2_input_power;                /* unit: W */
+    uint32_t pv1_input_voltage;              /* unit: 0.1V */
+    uint32_t pv2_input_voltage;              /* unit: 0.1V */
+    uint32_t mppt1_charger_status;
+    uint32_t mppt2_charger_status;
+    uint32_t load_connected;
+    uint32_t battery_power_direction;
+    uint32_t dc_ac_power_direction;
+    uint32_t line_power_direction;
+    uint32_t max_temp_present;
+    uint32_t max_temp;                       /* unit: C */
+};
+
+struct FaultsAndWarnings {
+    uint32_t fault_code;
+    uint32_t line_fail;
+    uint32_t output_circuit_short;
+    uint32_t inverter_over_temperature;
+    uint32_t fan_lock;
+    uint32_t battery_voltage_high;
+    uint32_t battery_low;
+    uint32_t battery_under;
+    uint32_t over_load;
+    uint32_t eeprom_fail;
+    uint32_t power_limit;
+    uint32_t pv1_voltage_high;
+    uint32_t pv2_voltage_high;
+    uint32_t mppt1_overload_warning;
+    uint32_t mppt2_overload_warning;
+    uint32_t battery_too_low_to_charge_for_scc1;
+    uint32_t battery_too_low_to_charge_for_scc2;
+};
+
+struct FlagsAndStatuses {
+    uint32_t buzzer;
+    uint32_t overload_bypass;
+    uint32_t lcd_escape_to_default_page_after_1min_timeout;
+    uint32_t overload_restart;
+    uint32_t over_temp_restart;
+    uint32_t backlight_on;
+    uint32_t alarm_on_primary_source_interrupt;
+    uint32_t fault_code_record;
+};
+
+template <typename T>
+struct Section {
+    std::atomic<uint32_t> sequence;
+    uint32_t valid;           /* 0 until the first update */
+    uint64_t unix_time;       /* time of the update, ms since epoch */
+    uint64_t monotonic_time;  /* same, CLOCK_MONOTONIC, ms */
+    T data;
+};
+
+struct Segment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;            /* sizeof(Segment) */
+    uint32_t reserved;
+    Section<GeneralStatus> general_status;
+    Section<ParallelGeneralStatus> parallel_general_status;
+    Section<FaultsAndWarnings> faults_and_warnings;
+    Section<FlagsAndStatuses> flags_and_statuses;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "seqlock needs lock-free atomics");
+
+
+// for the writer
+template <typename T>
+void shm_write(Section<T>& section, const T& data, uint64_t unixTime, uint64_t monotonicTime) {
+    uint32_t seq = section.sequence.load(std::memory_order_relaxed);
+    section.sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    section.valid = 1;
+    section.unix_time = unixTime;
+    section.monotonic_time = monotonicTime;
+    memcpy(&section.data, &data, sizeof(T));
+
+    section.sequence.store(seq + 2, std::memory_order_release);
+}
+
+// for readers; returns false if the section has never been updated
+template <typename T>
+bool shm_read(const Section<T>& section, T& data, uint64_t* unixTime = nullptr, uint64_t* monotonicTime = nullptr) {
+    while (true) {
+        uint32_t seq1 = section.sequence.load(std::memory_order_acquire);
+        if (seq1 & 1)
+            continue;
+
+        uint32_t valid = section.valid;
+        uint64_t ut = section.unix_time;
+        uint64_t mt = section.monotonic_time;
+        memcpy(&data, &section.data, sizeof(T));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (section.sequence.load(std::memory_order_relaxed) != seq1)
+            continue;
+
+        if (unixTime != nullptr)
+            *unixTime = ut;
+        if (monotonicTime != nullptr)
+            *monotonicTime = mt;
+        return valid != 0;
+    }
+}
+
+}
+
+#endif //INVERTER_TOOLS_SERVER_SHM_H
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "shm_publisher.h"
+#include "server.h"
+#include "../voltronic/time.h"
+#include "../util.h"
+
+namespace server {
+
+using namespace p18::response_type;
+
+ShmPublisher::ShmPublisher(std::string name) : name_(std::move(name)), segment_(nullptr) {
+    int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd == -1)
+        throw ServerError("shm_open(" + name_ + "): " + std::string(strerror(errno)));
+
+    if (ftruncate(fd, sizeof(shm::Segment)) == -1) {
+        close(fd);
+        throw ServerError("ftruncate(" + name_ + "): " + std::string(strerror(errno)));
+    }
+
+    void* ptr = mmap(nullptr, sizeof(shm::Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        throw ServerError("mmap(" + name_ + "): " + std::string(strerror(errno)));
+
+    // start from scratch, whatever was left there by the previous run
+    memset(ptr, 0, sizeof(shm::Segment));
+    segment_ = new (ptr) shm::Segment();
+    segment_->version = shm::VERSION;
+    segment_->size = sizeof(shm::Segment);
+    std::atomic_thread_fence(std::memory_order_release);
+    segment_->magic = shm::MAGIC;
+}
+
+ShmPublisher::~ShmPublisher() {
+    if (segment_ != nullptr)
+        munmap(segment_, sizeof(shm::Segment));
+    shm_unlink(name_.c_str());
+}
+
+bool ShmPublisher::isPublished(p18::CommandType commandType) {
+    switch (commandType) {
+        case p18::CommandType::GetGeneralStatus:
+        case p18::CommandType::GetParallelGeneralStatus:
+        case p18::CommandType::GetFaultsAndWarnings:
+        case p18::CommandType::GetFlagsAndStatuses:
+            return true;
+        default:
+            return false;
+    }
+}
+
+#define U32(field) static_cast<uint32_t>(r.field)
+
+void ShmPublisher::publish(p18::CommandType commandType,
+                           const std::vector<std::string>& arguments,
+                           const std::shared_ptr<BaseResponse>& response) {
+    struct timeval tv = {0};
+    gettimeofday(&tv, nullptr);
+    u64 unixTime = static_cast<u64>(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+    u64 monotonicTime = voltronic::timestamp();
+
+    switch (commandType) {
+        case p18::CommandType::GetGeneralStatus: {
+            auto& r = static_cast<const GeneralStatus&>(*response);
+            shm::GeneralStatus s {
+                U32(grid_voltage), U32(grid_freq), U32(ac_output_voltage), U32(ac_output_freq),
+                U32(ac_output_apparent_power), U32(ac_output_active_power), U32(output_load_percent),
+                U32(battery_voltage), U32(battery_voltage_scc), U32(battery_voltage_scc2),
+                U32(battery_discharge_current), U32(battery_charge_current), U32(battery_capacity),
+                U32(inverter_heat_sink_temp), U32(mppt1_charger_temp), U32(mppt2_charger_temp),
+                U32(pv1_input_power), U32(pv2_input_power), U32(pv1_input_voltage), U32(pv2_input_voltage),
+                U32(configuration_status), U32(mppt1_charger_status), U32(mppt2_charger_status),
+                U32(load_connected), U32(battery_power_direction), U32(dc_ac_power_direction),
+                U32(line_power_direction), U32(local_parallel_id)
+            };
+            shm::shm_write(segment_->general_status, s, unixTime, monotonicTime);
+            break;
+        }
+
+        case p18::CommandType::GetParallelGeneralStatus: {
+            auto& r = static_cast<const ParallelGeneralStatus&>(*response);
+            shm::ParallelGeneralStatus s {
+                arguments.empty() ? 0 : stou(arguments[0]),
+                U32(parallel_connection_status), U32(work_mode), U32(fault_code),
+                U32(grid_voltage), U32(grid_freq), U32(ac_output_voltage), U32(ac_output_freq),
+                U32(ac_output_apparent_power), U32(ac_output_active_power),
+                U32(total_ac_output_apparent_power), U32(total_ac_output_active_power),
+                U32(output_load_percent), U32(total_output_load_percent), U32(battery_voltage),
+                U32(battery_discharge_current), U32(battery_charge_current), U32(total_battery_charge_current),
+                U32(battery_capacity), U32(pv1_input_power), U32(pv2_input_power),
+                U32(pv1_input_voltage), U32(pv2_input_voltage), U32(mppt1_charger_status),
+                U32(mppt2_charger_status), U32(load_connected), U32(battery_power_direction),
+                U32(dc_ac_power_direction), U32(line_power_direction), U32(max_temp_present),
+                r.max_temp_present ? U32(max_temp) : 0
+            };
+            shm::shm_write(segment_->parallel_general_status, s, unixTime, monotonicTime);
+            break;
+        }
+
+        case p18::CommandType::GetFaultsAndWarnings: {
+            auto& r = static_cast<const FaultsAndWarnings&>(*response);
+            shm::FaultsAndWarnings s {
+                U32(fault_code), U32(line_fail), U32(output_circuit_short), U32(inverter_over_temperature),
+                U32(fan_lock), U32(battery_voltage_high), U32(battery_low), U32(battery_under),
+                U32(over_load), U32(eeprom_fail), U32(power_limit), U32(pv1_voltage_high),
+                U32(pv2_voltage_high), U32(mppt1_overload_warning), U32(mppt2_overload_warning),
+                U32(battery_too_low_to_charge_for_scc1), U32(battery_too_low_to_charge_for_scc2)
+            };
+            shm::shm_write(segment_->faults_and_warnings, s, unixTime, monotonicTime);
+            break;
+        }
+
+        case p18::CommandType::GetFlagsAndStatuses: {
+            auto& r = static_cast<const FlagsAndStatuses&>(*response);
+            shm::FlagsAndStatuses s {
+                U32(buzzer), U32(overload_bypass), U32(lcd_escape_to_default_page_after_1min_timeout),
+                U32(overload_restart), U32(over_temp_restart), U32(backlight_on),
+                U32(alarm_on_primary_source_interrupt), U32(fault_code_record)
+            };
+            shm::shm_write(segment_->flags_and_statuses, s, unixTime, monotonicTime);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+#undef U32
+
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef INVERTER_TOOLS_SERVER_SHM_PUBLISHER_H
+#define INVERTER_TOOLS_SERVER_SHM_PUBLISHER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "shm.h"
+#include "../p18/types.h"
+#include "../p18/response.h"
+
+namespace server {
+
+/**
+ * Owns the shared memory segment and copies responses of the commands it
+ * knows about into it. Must not be used from more than one thread at a time.
+ */
+class ShmPublisher {
+private:
+    std::string name_;
+    shm::Segment* segment_;
+
+public:
+    explicit ShmPublisher(std::string name);
+    ~ShmPublisher();
+
+    ShmPublisher(const ShmPublisher&) = delete;
+    ShmPublisher& operator=(const ShmPublisher&) = delete;
+
+    static bool isPublished(p18::CommandType commandType);
+
+    void publish(p18::CommandType commandType,
+                 const std::vector<std::string>& arguments,
+                 const std::shared_ptr<p18::response_type::BaseResponse>& response);
+};
+
+}
+
+#endif //INVERTER_TOOLS_SERVER_SHM_PUBLISHER_H
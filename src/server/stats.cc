@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <ios>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <nlohmann/json.hpp>
+
+#include "stats.h"
+#include "../p18/commands.h"
+
+namespace server {
+
+using nlohmann::ordered_json;
+
+static const char* stage_names[STAGES_COUNT] = {
+    "pack",
+    "send",
+    "first_byte",
+    "last_byte",
+    "validate",
+    "parse",
+    "execute",
+    "format",
+    "socket_send",
+};
+
+
+/**
+ * Histogram
+ */
+
+size_t Histogram::bucketIndex(u64 value) {
+    const u64 subBuckets = 1 << SUB_BUCKET_BITS;
+
+    if (value >= (1ULL << MAX_VALUE_BITS))
+        value = (1ULL << MAX_VALUE_BITS) - 1;
+
+    if (value < subBuckets)
+        return value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SUB_BUCKET_BITS;
+
+    return ((shift + 1) << SUB_BUCKET_BITS) + ((value >> shift) - subBuckets);
+}
+
+// middle of the bucket's range
+u64 Histogram::bucketValue(size_t index) {
+    const u64 subBuckets = 1 << SUB_BUCKET_BITS;
+
+    if (index < subBuckets)
+        return index;
+
+    int shift = static_cast<int>(index >> SUB_BUCKET_BITS) - 1;
+    u64 sub = index & (subBuckets - 1);
+
+    return ((subBuckets + sub) << shift) + ((1ULL << shift) >> 1);
+}
+
+void Histogram::record(u64 value) {
+    buckets_[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+
+    u64 max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed));
+}
+
+u64 Histogram::count() const {
+    return count_.load(std::memory_order_relaxed);
+}
+
+u64 Histogram::max() const {
+    return max_.load(std::memory_order_relaxed);
+}
+
+u64 Histogram::percentile(double p) const {
+    // buckets are being updated concurrently, so count them
+    // instead of relying on count_
+    std::array<u32, BUCKETS> snapshot {};
+    u64 total = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        snapshot[i] = buckets_[i].load(std::memory_order_relaxed);
+        total += snapshot[i];
+    }
+
+    if (!total)
+        return 0;
+
+    u64 rank = static_cast<u64>(p / 100.0 * static_cast<double>(total) + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    u64 seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        seen += snapshot[i];
+        if (seen >= rank)
+            return std::min(bucketValue(i), max());
+    }
+
+    return max();
+}
+
+
+/**
+ * Stats
+ */
+
+Stats::~Stats() {
+    for (auto& item: commands_)
+        delete item.load();
+}
+
+CommandStats& Stats::get(p18::CommandType commandType) {
+    auto& slot = commands_[p18::command_index(commandType)];
+
+    CommandStats* stats = slot.load(std::memory_order_acquire);
+    if (stats != nullptr)
+        return *stats;
+
+    auto created = new CommandStats();
+    if (slot.compare_exchange_strong(stats, created, std::memory_order_acq_rel))
+        return *created;
+
+    // someone else was faster
+    delete created;
+    return *stats;
+}
+
+void Stats::record(p18::CommandType commandType, Stage stage, u64 us) {
+    get(commandType).stage(stage).record(us);
+}
+
+void Stats::recordExecution(p18::CommandType commandType,
+                            const p18::ClientTimings& timings,
+                            const voltronic::DeviceTimings& deviceTimings) {
+    CommandStats& stats = get(commandType);
+
+    stats.stage(Stage::Pack).record(timings.pack);
+    stats.stage(Stage::Send).record(deviceTimings.send);
+    stats.stage(Stage::FirstByte).record(deviceTimings.firstByte);
+    stats.stage(Stage::LastByte).record(deviceTimings.lastByte);
+    stats.stage(Stage::Validate).record(timings.validate);
+    stats.stage(Stage::Parse).record(timings.parse);
+    stats.stage(Stage::Execute).record(timings.pack + timings.device + timings.validate + timings.parse);
+}
+
+
+/**
+ * Output
+ */
+
+struct StatsLine {
+    std::string command;
+    std::string stage;
+    u64 count;
+    u64 p50;
+    u64 p99;
+    u64 max;
+};
+
+struct StatsCounters {
+    std::string command;
+    u64 cacheHits;
+    u64 cacheMisses;
+    u64 errors;
+};
+
+class StatsTable : public formatter::Formattable {
+private:
+    std::vector<StatsCounters> counters_;
+    std::vector<StatsLine> lines_;
+
+public:
+    StatsTable(formatter::Format format, std::vector<StatsCounters> counters, std::vector<StatsLine> lines)
+        : formatter::Formattable(format), counters_(std::move(counters)), lines_(std::move(lines)) {}
+
+    std::ostream& writeTable(std::ostream& os) const override {
+        std::ios_base::fmtflags f(os.flags());
+        os << std::left;
+
+        os << std::setw(32) << "Command" << std::setw(8) << "Hits" << std::setw(8) << "Misses" << "Errors";
+        for (const auto& c: counters_)
+            os << "\n" << std::setw(32) << c.command << std::setw(8) << c.cacheHits << std::setw(8) << c.cacheMisses << c.errors;
+
+        os << "\n\n" << std::setw(32) << "Command" << std::setw(13) << "Stage" << std::setw(8) << "Count"
+           << std::setw(10) << "p50, us" << std::setw(10) << "p99, us" << "max, us";
+        for (const auto& l: lines_) {
+            os << "\n" << std::setw(32) << l.command << std::setw(13) << l.stage << std::setw(8) << l.count
+               << std::setw(10) << l.p50 << std::setw(10) << l.p99 << l.max;
+        }
+
+        os.flags(f);
+        return os;
+    }
+
+    std::ostream& writeSimpleTable(std::ostream& os) const override {
+        bool first = true;
+        auto line = [&os, &first]() -> std::ostream& {
+            if (!first)
+                os << std::endl;
+            first = false;
+            return os;
+        };
+
+        for (const auto& c: counters_) {
+            line() << c.command << ".hits " << c.cacheHits;
+            line() << c.command << ".misses " << c.cacheMisses;
+            line() << c.command << ".errors " << c.errors;
+        }
+        for (const auto& l: lines_) {
+            line() << l.command << "." << l.stage << ".count " << l.count;
+            line() << l.command << "." << l.stage << ".p50 " << l.p50;
+            line() << l.command << "." << l.stage << ".p99 " << l.p99;
+            line() << l.command << "." << l.stage << ".max " << l.max;
+        }
+        return os;
+    }
+
+    std::ostream& writeJSON(std::ostream& os) const override {
+        ordered_json data = ordered_json::object();
+
+        for (const auto& c: counters_) {
+            data[c.command]["hits"] = c.cacheHits;
+            data[c.command]["misses"] = c.cacheMisses;
+            data[c.command]["errors"] = c.errors;
+        }
+        for (const auto& l: lines_) {
+            data[l.command][l.stage] = {
+                {"count", l.count},
+                {"p50", l.p50},
+                {"p99", l.p99},
+                {"max", l.max}
+            };
+        }
+
+        ordered_json j = {
+            {"result", "ok"},
+            {"data", data}
+        };
+        return os << j.dump();
+    }
+
+    std::ostream& writeSimpleJSON(std::ostream& os) const override {
+        return writeJSON(os);
+    }
+};
+
+std::shared_ptr<formatter::Formattable> Stats::format(formatter::Format format) const {
+    std::vector<StatsCounters> counters;
+    std::vector<StatsLine> lines;
+
+    for (const auto& item: p18::client_commands) {
+        const CommandStats* stats = commands_[p18::command_index(item.second)].load(std::memory_order_acquire);
+        if (stats == nullptr)
+            continue;
+
+        counters.push_back({
+            item.first,
+            stats->cacheHits.load(std::memory_order_relaxed),
+            stats->cacheMisses.load(std::memory_order_relaxed),
+            stats->errors.load(std::memory_order_relaxed)
+        });
+
+        for (size_t i = 0; i < STAGES_COUNT; i++) {
+            const Histogram& h = stats->stages[i];
+            if (!h.count())
+                continue;
+
+            lines.push_back({
+                item.first,
+                stage_names[i],
+                h.count(),
+                h.percentile(50),
+                h.percentile(99),
+                h.max()
+            });
+        }
+    }
+
+    return std::shared_ptr<formatter::Formattable>(new StatsTable(format, counters, lines));
+}
+
+}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef INVERTER_TOOLS_SERVER_STATS_H
+#define INVERTER_TOOLS_SERVER_STATS_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+
+#include "../numeric_types.h"
+#include "../formatter/formatter.h"
+#include "../p18/types.h"
+#include "../p18/functions.h"
+#include "../p18/client.h"
+#include "../voltronic/device.h"
+
+namespace server {
+
+/**
+ * Log-linear histogram of microsecond values, HDR-style: every power of two
+ * is split into 2^SUB_BUCKET_BITS buckets, which gives ~12% precision.
+ * Recording is lock-free and safe to do from any thread.
+ */
+class Histogram {
+public:
+    static const int SUB_BUCKET_BITS = 3;
+    static const int MAX_VALUE_BITS = 32; /* ~71 minutes */
+    static const size_t BUCKETS = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+    void record(u64 value);
+
+    u64 count() const;
+    u64 max() const;
+    u64 percentile(double p) const;
+
+private:
+    std::array<std::atomic<u32>, BUCKETS> buckets_{};
+    std::atomic<u64> count_{0};
+    std::atomic<u64> max_{0};
+
+    static size_t bucketIndex(u64 value);
+    static u64 bucketValue(size_t index);
+};
+
+
+enum class Stage {
+    Pack = 0,   /* building the request */
+    Send,       /* from the start of device exchange, till the request is written */
+    FirstByte,  /* from the start of device exchange, till the first byte is read */
+    LastByte,   /* from the start of device exchange, till the whole frame is read */
+    Validate,
+    Parse,
+    Execute,    /* whole p18::Client::execute() */
+    Format,
+    SocketSend,
+};
+const size_t STAGES_COUNT = static_cast<size_t>(Stage::SocketSend) + 1;
+
+struct CommandStats {
+    std::array<Histogram, STAGES_COUNT> stages;
+    std::atomic<u64> cacheHits{0};
+    std::atomic<u64> cacheMisses{0};
+    std::atomic<u64> errors{0};
+
+    Histogram& stage(Stage s) {
+        return stages[static_cast<size_t>(s)];
+    }
+};
+
+
+class Stats {
+private:
+    // allocated on first use, most commands are never used
+    std::array<std::atomic<CommandStats*>, p18::COMMANDS_COUNT> commands_{};
+
+public:
+    Stats() = default;
+    ~Stats();
+
+    Stats(const Stats&) = delete;
+    Stats& operator=(const Stats&) = delete;
+
+    CommandStats& get(p18::CommandType commandType);
+
+    void record(p18::CommandType commandType, Stage stage, u64 us);
+    void recordExecution(p18::CommandType commandType,
+                         const p18::ClientTimings& timings,
+                         const voltronic::DeviceTimings& deviceTimings);
+
+    std::shared_ptr<formatter::Formattable> format(formatter::Format format) const;
+};
+
+}
+
+#endif //INVERTER_TOOLS_SERVER_STATS_H
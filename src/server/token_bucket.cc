@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <algorithm>
+
+#include "token_bucket.h"
+#include "../voltronic/time.h"
+
+namespace server {
+
+TokenBucket::TokenBucket(double rate, double burst)
+    : rate_(rate)
+    , burst_(std::max(burst, 1.0))
+    , tokens_(burst_)
+    , lastTime_(voltronic::timestamp()) {}
+
+bool TokenBucket::take() {
+    if (!rate_)
+        return true;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    u64 now = voltronic::timestamp();
+    tokens_ = std::min(burst_, tokens_ + static_cast<double>(now - lastTime_) * rate_ / 1000);
+    lastTime_ = now;
+
+    if (tokens_ < 1)
+        return false;
+
+    tokens_ -= 1;
+    return true;
+}
+
+bool TokenBucket::isIdle() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !rate_ || tokens_ + static_cast<double>(voltronic::timestamp() - lastTime_) * rate_ / 1000 >= burst_;
+}
+
+}
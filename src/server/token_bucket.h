@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef INVERTER_TOOLS_SERVER_TOKEN_BUCKET_H
+#define INVERTER_TOOLS_SERVER_TOKEN_BUCKET_H
+
+#include <mutex>
+
+#include "../numeric_types.h"
+
+namespace server {
+
+/**
+ * Allows `rate` events per second on average, and up to `burst` at once.
+ * A zero rate means no limit.
+ */
+class TokenBucket {
+private:
+    std::mutex mutex_;
+    double rate_;
+    double burst_;
+    double tokens_;
+    u64 lastTime_;
+
+public:
+    explicit TokenBucket(double rate = 0, double burst = 0);
+
+    bool take();
+
+    // true if the bucket has been full for a while, so forgetting it changes nothing
+    bool isIdle();
+};
+
+}
+
+#endif //INVERTER_TOOLS_SERVER_TOKEN_BUCKET_H
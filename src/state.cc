@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+
+#include "state.h"
+#include "logging.h"
+
+std::string state_file_name(const std::string& prefix, const std::string& id) {
+    std::string name = prefix;
+    for (char c: id) {
+        if (isalnum(c) || c == '-' || c == '.')
+            name += c;
+        else
+            name += '_';
+    }
+    return name;
+}
+
+bool state_load(const std::string& dir, const std::string& name, std::string& value) {
+    if (dir.empty())
+        return false;
+
+    std::ifstream f(dir + "/" + name);
+    if (!f.is_open())
+        return false;
+
+    std::ostringstream buf;
+    buf << f.rdbuf();
+    value = buf.str();
+
+    return true;
+}
+
+void state_save(const std::string& dir, const std::string& name, const std::string& value) {
+    if (dir.empty())
+        return;
+
+    std::string path = dir + "/" + name;
+    std::string tmpPath = path + ".tmp";
+
+    // write to a temporary file first, so that readers never see it half-written
+    {
+        std::ofstream f(tmpPath, std::ios::trunc);
+        if (!f.is_open()) {
+            myerr << "failed to open " << tmpPath << ": " << strerror(errno);
+            return;
+        }
+        f << value;
+    }
+
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        myerr << "failed to rename " << tmpPath << ": " << strerror(errno);
+}
@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef INVERTER_TOOLS_STATE_H
+#define INVERTER_TOOLS_STATE_H
+
+#include <string>
+
+// Small files in the state directory (--state-dir), used to remember things
+// between runs. All functions do nothing if dir is empty.
+
+std::string state_file_name(const std::string& prefix, const std::string& id);
+bool state_load(const std::string& dir, const std::string& name, std::string& value);
+void state_save(const std::string& dir, const std::string& name, const std::string& value);
+
+#endif //INVERTER_TOOLS_STATE_H
@@ -13,7 +13,44 @@ typedef u16 CRC;
 
 void crc_write(CRC crc, u8* buffer);
 CRC crc_read(const u8* buf);
-CRC crc_calculate(const u8* buf, size_t bufSize);
+
+inline constexpr u16 crc_table[16] = {
+        0x0000, 0x1021, 0x2042, 0x3063,
+        0x4084, 0x50A5, 0x60C6, 0x70E7,
+        0x8108, 0x9129, 0xA14A, 0xB16B,
+        0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+constexpr bool crc_is_reserved(u8 b) {
+    return b == 0x28 || b == 0x0D || b == 0x0A;
+}
+
+// constexpr, so that crc of constant frames can be computed at compile time
+constexpr CRC crc_calculate(const u8* buf, size_t bufSize) {
+    CRC crc = 0;
+
+    if (bufSize > 0) {
+        u8 byte = 0;
+        do {
+            byte = *buf;
+
+            crc = crc_table[(crc >> 12) ^ (byte >> 4)] ^ (crc << 4);
+            crc = crc_table[(crc >> 12) ^ (byte & 0x0F)] ^ (crc << 4);
+
+            buf += 1;
+        } while (--bufSize);
+
+        byte = crc;
+        if (crc_is_reserved(byte))
+            crc += 1;
+
+        byte = crc >> 8;
+        if (crc_is_reserved(byte))
+            crc += 1 << 8;
+    }
+
+    return crc;
+}
 
 }
 
@@ -4,7 +4,9 @@
 #include <iostream>
 #include <limits>
 #include <cstring>
+#include <cctype>
 #include <sstream>
+#include <algorithm>
 
 #include "crc.h"
 #include "device.h"
@@ -17,7 +19,10 @@ namespace voltronic {
 
 Device::Device() :
     flags_(FLAG_WRITE_CRC | FLAG_READ_CRC | FLAG_VERIFY_CRC),
-    timeout_(TIMEOUT) {}
+    timeout_(TIMEOUT),
+    timeStarted_(0),
+    timeStartedUs_(0),
+    verbose_(false) {}
 
 void Device::setFlags(int flags) {
     flags_ = flags;
@@ -27,6 +32,10 @@ int Device::getFlags() const {
     return flags_;
 }
 
+const DeviceTimings& Device::getTimings() const {
+    return timings_;
+}
+
 void Device::setVerbose(bool verbose) {
     verbose_ = verbose;
 }
@@ -35,6 +44,10 @@ void Device::setTimeout(u64 timeout) {
     timeout_ = timeout;
 }
 
+u64 Device::getTimeout() const {
+    return timeout_;
+}
+
 u64 Device::getElapsedTime() const {
     return timestamp() - timeStarted_;
 }
@@ -51,46 +64,62 @@ u64 Device::getTimeLeft() const {
 }
 
 size_t Device::run(const u8* inbuf, size_t inbufSize, u8* outbuf, size_t outbufSize) {
-    timeStarted_ = timestamp();
+    return exchange(inbuf, inbufSize, false, outbuf, outbufSize);
+}
 
-    send(inbuf, inbufSize);
+size_t Device::runFrame(const u8* frame, size_t frameSize, u8* outbuf, size_t outbufSize) {
+    return exchange(frame, frameSize, true, outbuf, outbufSize);
+}
 
-    if (!getTimeLeft()) {
-        // FIXME
-        // we should read incoming data from the device,
-        // or clean the buffer in some other way.
-        // otherwise we may get invalid response next time
+size_t Device::exchange(const u8* inbuf, size_t inbufSize, bool complete, u8* outbuf, size_t outbufSize) {
+    timeStartedUs_ = timestamp_us();
+    timeStarted_ = timeStartedUs_ / 1000;
+    timings_ = DeviceTimings();
+
+    // if the previous exchange timed out, the rest of its response may still
+    // be sitting in the input buffer; get rid of it before sending anything,
+    // otherwise it will be taken for the beginning of the new response
+    drain();
+
+    if (complete)
+        sendFrame(inbuf, inbufSize);
+    else
+        send(inbuf, inbufSize);
+    timings_.send = timestamp_us() - timeStartedUs_;
+
+    if (!getTimeLeft())
         throw TimeoutError("sending already took " + std::to_string(getElapsedTime()) + " ms");
-    }
 
     return recv(outbuf, outbufSize);
 }
 
 void Device::send(const u8* buf, size_t bufSize) {
-    size_t dataLen;
-    std::shared_ptr<u8> data;
-
-    if ((flags_ & FLAG_WRITE_CRC) == FLAG_WRITE_CRC) {
-        const CRC crc = crc_calculate(buf, bufSize);
-        dataLen = bufSize + sizeof(u16) + 1;
-        data = std::unique_ptr<u8>(new u8[dataLen]);
-        crc_write(crc, &data.get()[bufSize]);
-    } else {
-        dataLen = bufSize + 1;
-        data = std::unique_ptr<u8>(new u8[dataLen]);
-    }
+    // requests are short, no need for the heap
+    u8 data[MAX_REQUEST_SIZE];
+    size_t dataLen = bufSize + 1;
+    bool writeCrc = (flags_ & FLAG_WRITE_CRC) == FLAG_WRITE_CRC;
+    if (writeCrc)
+        dataLen += sizeof(u16);
 
-    u8* dataPtr = data.get();
-    memcpy((void*)dataPtr, buf, bufSize);
+    if (dataLen > sizeof(data))
+        throw std::length_error("request is too long");
 
-    dataPtr[dataLen - 1] = '\r';
+    memcpy(data, buf, bufSize);
+    if (writeCrc)
+        crc_write(crc_calculate(buf, bufSize), &data[bufSize]);
 
+    data[dataLen - 1] = '\r';
+
+    sendFrame(data, dataLen);
+}
+
+void Device::sendFrame(const u8* frame, size_t frameSize) {
     if (verbose_) {
-        myerr << "writing " << dataLen << (dataLen > 1 ? " bytes" : " byte");
-        std::cerr << hexdump(dataPtr, dataLen);
+        myerr << "writing " << frameSize << (frameSize > 1 ? " bytes" : " byte");
+        std::cerr << hexdump(const_cast<u8*>(frame), frameSize);
     }
 
-    writeLoop(dataPtr, dataLen);
+    writeLoop(frame, frameSize);
 }
 
 void Device::writeLoop(const u8* data, size_t dataSize) {
@@ -149,29 +178,122 @@ size_t Device::recv(u8* buf, size_t bufSize) {
 
 size_t Device::readLoop(u8 *buf, size_t bufSize) {
     size_t size = 0;
+    size_t frameSize = 0;
+
+    while (true) {
+        if (size >= bufSize)
+            throw std::overflow_error("input buffer is not large enough");
 
-    while(true) {
-        size_t bytesRead = read(buf, bufSize);
+        // with crc, ask for exactly as many bytes as still missing: the header
+        // first, then the rest of the frame once its size is known. Without it
+        // the size is unknown, so take whatever there is and look for CR
+        size_t bytesWanted;
+        if (frameSize)
+            bytesWanted = frameSize - size;
+        else if (flags_ & FLAG_READ_CRC)
+            bytesWanted = size < FRAME_HEADER_SIZE ? FRAME_HEADER_SIZE - size : 1;
+        else
+            bytesWanted = bufSize - size;
+
+        size_t bytesRead = read(&buf[size], std::min(bytesWanted, bufSize - size));
         if (verbose_)
             myerr << "bytesRead=" << bytesRead;
 
-        while (bytesRead) {
-            bytesRead--;
-            size++;
+        if (!timings_.firstByte && bytesRead)
+            timings_.firstByte = timestamp_us() - timeStartedUs_;
+
+        size += bytesRead;
 
-            if (*buf == '\r')
-                return size;
+        if (!frameSize) {
+            size = findFrameStart(buf, size);
+            frameSize = getFrameSize(buf, size);
 
-            buf++;
-            bufSize--;
+            // the header is junk, skip its marker and look for the next one
+            while (frameSize > bufSize) {
+                if (verbose_)
+                    myerr << "invalid frame header, resynchronizing";
+                buf[0] = 0;
+                size = findFrameStart(buf, size);
+                frameSize = getFrameSize(buf, size);
+            }
+        }
+
+        if (frameSize && size >= frameSize) {
+            if (buf[frameSize - 1] != '\r')
+                throw InvalidDataError("frame is not terminated with CR");
+            timings_.lastByte = timestamp_us() - timeStartedUs_;
+            return frameSize;
+        }
+
+        // frame size can't be figured out from the header without crc,
+        // so just wait for CR
+        if (!frameSize && size >= 2 && !(flags_ & FLAG_READ_CRC)) {
+            u8* end = (u8*)memchr(buf, '\r', size);
+            if (end != nullptr) {
+                timings_.lastByte = timestamp_us() - timeStartedUs_;
+                return end - buf + 1;
+            }
         }
 
         if (!getTimeLeft())
             throw TimeoutError("data reading already took " + std::to_string(getElapsedTime()) + " ms");
+    }
+}
 
-        if (bufSize <= 0)
-            throw std::overflow_error("input buffer is not large enough");
+/**
+ * Looks for the start of a frame (^D, ^0 or ^1) and moves it to the beginning
+ * of the buffer, discarding everything before it.
+ *
+ * Returns new size of the data in the buffer.
+ */
+size_t Device::findFrameStart(u8* buf, size_t size) const {
+    size_t pos = 0;
+    for (; pos < size; pos++) {
+        if (buf[pos] != '^')
+            continue;
+
+        // marker at the very end, wait for more data
+        if (pos + 1 == size)
+            break;
+
+        u8 type = buf[pos + 1];
+        if (type == 'D' || type == '0' || type == '1')
+            break;
+    }
+
+    if (pos > 0) {
+        if (verbose_)
+            myerr << "discarding " << pos << (pos > 1 ? " bytes" : " byte") << " of stale data";
+        memmove(buf, &buf[pos], size - pos);
     }
+
+    return size - pos;
+}
+
+/**
+ * Returns full size of the frame (including crc and CR) that starts at the
+ * beginning of the buffer, or 0 if it can't be determined yet.
+ */
+size_t Device::getFrameSize(const u8* buf, size_t size) const {
+    if (!(flags_ & FLAG_READ_CRC) || size < 2)
+        return 0;
+
+    // ^0 or ^1, response to a set command
+    if (buf[1] != 'D')
+        return 2 + sizeof(u16) + 1;
+
+    if (size < FRAME_HEADER_SIZE)
+        return 0;
+
+    // ^Dnnn, where nnn is length of the data, plus crc and CR
+    size_t len = 0;
+    for (size_t i = 2; i < FRAME_HEADER_SIZE; i++) {
+        if (!isdigit(buf[i]))
+            return std::numeric_limits<size_t>::max();
+        len = len * 10 + (buf[i] - '0');
+    }
+
+    return FRAME_HEADER_SIZE + len;
 }
 
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 
 #include <string>
 #include <memory>
+#include <array>
 #include <hidapi/hidapi.h>
 #include <libserialport.h>
 
@@ -23,36 +24,64 @@ enum {
  * Common device
  */
 
+// timeline of the last run(), in microseconds since its start
+struct DeviceTimings {
+    u64 send = 0;
+    u64 firstByte = 0;
+    u64 lastByte = 0;
+};
+
 class Device {
 protected:
     int flags_;
     u64 timeout_;
     u64 timeStarted_;
+    u64 timeStartedUs_;
     bool verbose_;
+    DeviceTimings timings_;
 
+    size_t exchange(const u8* inbuf, size_t inbufSize, bool complete, u8* outbuf, size_t outbufSize);
     void send(const u8* buf, size_t bufSize);
+    void sendFrame(const u8* frame, size_t frameSize);
     size_t recv(u8* buf, size_t bufSize);
 
     void writeLoop(const u8* data, size_t dataSize);
     size_t readLoop(u8* buf, size_t bufSize);
 
+    size_t findFrameStart(u8* buf, size_t size) const;
+    size_t getFrameSize(const u8* buf, size_t size) const;
+
     u64 getElapsedTime() const;
     u64 getTimeLeft() const;
 
 public:
     static const u64 TIMEOUT = 1000;
+    static const size_t FRAME_HEADER_SIZE = 5; /* ^Dnnn */
+    static const size_t MAX_REQUEST_SIZE = 256; /* including crc and CR */
 
     Device();
 
+    // readLoop() asks for exactly as many bytes as it still needs,
+    // so implementations may block until all of them arrive
     virtual size_t read(u8* buf, size_t bufSize) = 0;
     virtual size_t write(const u8* data, size_t dataSize) = 0;
 
+    // discard any pending input, such as late bytes of the previous
+    // response that arrived after we gave up waiting for it
+    virtual void drain() = 0;
+
     void setTimeout(u64 timeout);
+    u64 getTimeout() const;
     size_t run(const u8* inbuf, size_t inbufSize, u8* outbuf, size_t outbufSize);
 
+    // same as run(), but the frame already ends with crc and CR and is sent as is
+    size_t runFrame(const u8* frame, size_t frameSize, u8* outbuf, size_t outbufSize);
+
     void setFlags(int flags);
     int getFlags() const;
 
+    const DeviceTimings& getTimings() const;
+
     void setVerbose(bool verbose);
 };
 
@@ -79,6 +108,13 @@ public:
 
     size_t read(u8* buf, size_t bufSize) override;
     size_t write(const u8* data, size_t dataSize) override;
+    void drain() override;
+
+private:
+    // the rest of the last HID report that didn't fit into the read buffer
+    u8 report_[HID_REPORT_SIZE];
+    size_t reportOffset_ = 0;
+    size_t reportSize_ = 0;
 };
 
 
@@ -119,11 +155,12 @@ private:
     SerialParity parity_;
     std::string name_;
 
-    unsigned getTimeout();
+    unsigned getPortTimeout();
 
 public:
     static const char* DEVICE_NAME;
     static const SerialBaudRate BAUD_RATE = 2400;
+    static const SerialBaudRate BAUD_RATE_AUTO = 0;
     static const SerialDataBits DATA_BITS = SerialDataBits::Eight;
     static const SerialStopBits STOP_BITS = SerialStopBits::One;
     static const SerialParity PARITY = SerialParity::None;
@@ -139,8 +176,19 @@ public:
         return port_;
     }
 
+    [[nodiscard]] inline const std::string& getName() const {
+        return name_;
+    }
+
+    [[nodiscard]] inline SerialBaudRate getBaudRate() const {
+        return baudRate_;
+    }
+
+    void setBaudRate(SerialBaudRate baudRate);
+
     size_t read(u8* buf, size_t bufSize) override;
     size_t write(const u8* data, size_t dataSize) override;
+    void drain() override;
 };
 
 class SerialPortConfiguration {
@@ -155,6 +203,8 @@ public:
     void setConfiguration(SerialBaudRate baudRate, SerialDataBits dataBits, SerialStopBits stopBits, SerialParity parity);
 };
 
+extern const std::array<SerialBaudRate, 10> serial_baud_rates;
+
 bool is_serial_baud_rate_valid(SerialBaudRate baudRate);
 bool is_serial_data_bits_valid(SerialDataBits dataBits);
 bool is_serial_stop_bits_valid(SerialStopBits stopBits);
@@ -166,12 +216,56 @@ bool is_serial_parity_valid(SerialParity parity);
  */
 
 class PseudoDevice : public Device {
+private:
+    size_t responseOffset_ = 0;
+
 public:
     PseudoDevice() = default;
     ~PseudoDevice() = default;
 
     size_t read(u8* buf, size_t bufSize) override;
     size_t write(const u8* data, size_t dataSize) override;
+    void drain() override {}
+};
+
+
+/**
+ * Simulated device
+ */
+
+// faults injected by SimulatedDevice, rates are probabilities per request (0 to 1)
+struct SimulatorFaults {
+    u64 latency = 0;            /* ms before the response starts to arrive */
+    u64 jitter = 0;             /* ms, latency varies by up to this much either way */
+    double crcErrorRate = 0;    /* a bit of the response is flipped */
+    double truncateRate = 0;    /* the response is cut short */
+    double timeoutRate = 0;     /* the response never comes */
+};
+
+struct SimulatorState;
+
+// Stateful model of a P18 inverter for load and soak testing without hardware.
+// Every command is answered, status values evolve over time (time of day, load,
+// battery charge, grid outages) and set commands change what is reported later.
+class SimulatedDevice : public Device {
+private:
+    SimulatorFaults faults_;
+    std::unique_ptr<SimulatorState> state_;
+    std::string input_;
+    std::string output_;
+    size_t outputOffset_ = 0;
+    u64 readyAt_ = 0; /* us, when output_ arrives */
+
+    std::string respond(const std::string& request);
+    void inject(std::string& frame);
+
+public:
+    explicit SimulatedDevice(const SimulatorFaults& faults = SimulatorFaults());
+    ~SimulatedDevice();
+
+    size_t read(u8* buf, size_t bufSize) override;
+    size_t write(const u8* data, size_t dataSize) override;
+    void drain() override;
 };
 
 }
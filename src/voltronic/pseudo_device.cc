@@ -3,6 +3,9 @@
 #include <stdexcept>
 #include <sstream>
 #include <cstring>
+#include <algorithm>
+#include <vector>
+#include <iostream>
 
 #include "device.h"
 #include "crc.h"
@@ -34,25 +37,26 @@ size_t PseudoDevice::read(u8* buf, size_t bufSize) {
     if (flags_ & FLAG_READ_CRC)
         responseSize += 2;
 
-    if (responseSize + 1 > bufSize) {
-        std::ostringstream error;
-        error << "buffer is not large enough (" << (responseSize + 1) << " > " << bufSize << ")";
-        throw std::overflow_error(error.str());
-    }
-
-    memcpy(buf, response, responseSize);
+    std::vector<u8> frame(responseSize + 1);
+    memcpy(frame.data(), response, pseudoResponseSize);
 
     if (flags_ & FLAG_READ_CRC) {
-        CRC crc = crc_calculate(buf, pseudoResponseSize);
-        crc_write(crc, &buf[pseudoResponseSize]);
+        CRC crc = crc_calculate(frame.data(), pseudoResponseSize);
+        crc_write(crc, &frame[pseudoResponseSize]);
     }
 
-    buf[responseSize] = '\r';
+    frame[responseSize] = '\r';
+
+    // behave like a real stream, return no more than was asked for
+    size_t size = std::min(bufSize, responseSize + 1 - responseOffset_);
+    memcpy(buf, &frame[responseOffset_], size);
+    responseOffset_ += size;
 
-    return responseSize + 1;
+    return size;
 }
 
 size_t PseudoDevice::write(const u8* data, size_t dataSize) {
+    responseOffset_ = 0;
     if (verbose_) {
         myerr << "dataSize=" << dataSize;
         std::cerr << hexdump((void*)data, dataSize);
@@ -30,12 +30,24 @@ SerialDevice::SerialDevice(std::string& name,
     if (sp_open(port_, SP_MODE_READ_WRITE) != SP_OK)
         throw DeviceError("failed to open device");
 
+    // the actual rate is going to be detected by the caller
+    if (baudRate_ == BAUD_RATE_AUTO)
+        baudRate_ = BAUD_RATE;
+
     SerialPortConfiguration config(*this);
     config.setConfiguration(baudRate_, dataBits_, stopBits_, parity_);
 
     sp_flush(port_, SP_BUF_BOTH);
 }
 
+void SerialDevice::setBaudRate(SerialBaudRate baudRate) {
+    SerialPortConfiguration config(*this);
+    config.setConfiguration(baudRate, dataBits_, stopBits_, parity_);
+    baudRate_ = baudRate;
+
+    sp_flush(port_, SP_BUF_BOTH);
+}
+
 SerialDevice::~SerialDevice() {
     if (port_ != nullptr) {
         if (sp_close(port_) == SP_OK)
@@ -43,7 +55,7 @@ SerialDevice::~SerialDevice() {
     }
 }
 
-unsigned int SerialDevice::getTimeout() {
+unsigned int SerialDevice::getPortTimeout() {
     return !timeout_
            // to wait indefinitely if no timeout set
            ? 0
@@ -55,11 +67,25 @@ unsigned int SerialDevice::getTimeout() {
 size_t SerialDevice::read(u8* buf, size_t bufSize) {
     if (verbose_)
         myerr << "reading...";
-    return sp_blocking_read_next(port_, buf, bufSize, getTimeout());
+
+    // wait for the whole chunk instead of returning after every few bytes;
+    // without crc readLoop() doesn't know how much to expect and asks for as
+    // much as fits, so return as soon as something arrives
+    int bytesRead = (flags_ & FLAG_READ_CRC)
+        ? sp_blocking_read(port_, buf, bufSize, getPortTimeout())
+        : sp_blocking_read_next(port_, buf, bufSize, getPortTimeout());
+    if (bytesRead < 0)
+        throw DeviceError("failed to read from serial port");
+    return bytesRead;
 }
 
 size_t SerialDevice::write(const u8* data, size_t dataSize) {
-    return sp_blocking_write(port_, data, dataSize, getTimeout());
+    return sp_blocking_write(port_, data, dataSize, getPortTimeout());
+}
+
+void SerialDevice::drain() {
+    if (sp_flush(port_, SP_BUF_INPUT) != SP_OK)
+        throw DeviceError("failed to flush input buffer");
 }
 
 
@@ -102,23 +128,12 @@ void SerialPortConfiguration::setConfiguration(SerialBaudRate baudRate,
         throw DeviceError("failed to set port configuration");
 }
 
-bool is_serial_baud_rate_valid(SerialBaudRate baudRate) {
-    switch (baudRate) {
-        case 110:
-        case 300:
-        case 1200:
-        case 2400:
-        case 4800:
-        case 9600:
-        case 19200:
-        case 38400:
-        case 57600:
-        case 115200:
-            return true;
+const std::array<SerialBaudRate, 10> serial_baud_rates = {
+    110, 300, 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200
+};
 
-        default: break;
-    }
-    return false;
+bool is_serial_baud_rate_valid(SerialBaudRate baudRate) {
+    return std::find(serial_baud_rates.begin(), serial_baud_rates.end(), baudRate) != serial_baud_rates.end();
 }
 
 bool is_serial_data_bits_valid(SerialDataBits dataBits) {
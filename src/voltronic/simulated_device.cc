@@ -0,0 +1,802 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <random>
+#include <map>
+#include <array>
+#include <vector>
+#include <cmath>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <unistd.h>
+
+#include "device.h"
+#include "crc.h"
+#include "time.h"
+#include "hexdump/hexdump.h"
+#include "../logging.h"
+
+namespace voltronic {
+
+static const double RATED_POWER = 5000;        /* W */
+static const double PV_PEAK_POWER = 4000;      /* W, both strings at noon under a clear sky */
+static const double BATTERY_CAPACITY = 9600;   /* Wh, 48 V 200 Ah */
+
+// read() sleeps no longer than this (ms) while there's nothing to return,
+// so readLoop() still notices the timeout in time
+static const u64 POLL_INTERVAL = 10;
+
+static const std::array<unsigned, 8> allowed_charge_currents = {10, 20, 30, 40, 50, 60, 70, 80};
+static const std::array<unsigned, 9> allowed_ac_charge_currents = {2, 10, 20, 30, 40, 50, 60, 70, 80};
+
+
+/**
+ * Model
+ */
+
+struct SimulatorState {
+    // what set commands change, voltages are in 0.1 V
+    struct Settings {
+        unsigned acOutputVoltage = 2300;
+        unsigned acOutputFreq = 500;            /* 0.1 Hz */
+        unsigned inputVoltageRange = 0;
+        unsigned batteryUnderVoltage = 440;
+        unsigned batteryFloatVoltage = 540;
+        unsigned batteryBulkVoltage = 564;
+        unsigned batteryRechargeVoltage = 460;
+        unsigned batteryRedischargeVoltage = 540;
+        unsigned maxChargeCurrent = 60;         /* A */
+        unsigned maxACChargeCurrent = 30;       /* A */
+        unsigned batteryType = 2;
+        unsigned outputSourcePriority = 0;
+        unsigned chargeSourcePriority = 0;
+        unsigned solarPowerPriority = 1;
+        unsigned outputMode = 0;
+        std::array<bool, 9> flags = {true, false, false, true, true, true, true, true, false}; /* A to I */
+    };
+
+    const Settings defaults;
+    Settings settings;
+    bool settingsChanged = false;
+    bool acSupply = true;
+    std::string serialNumber = "96161801100095";
+    std::array<unsigned, 4> acChargeTime = {0, 0, 0, 0};    /* start h, m, end h, m */
+    std::array<unsigned, 4> acSupplyTime = {0, 0, 0, 0};
+    time_t timeOffset = 0;                                  /* s, set with DAT */
+
+    std::map<unsigned, double> generated;                   /* Wh per yyyymmdd */
+    double batteryCharge = BATTERY_CAPACITY * 0.7;          /* Wh */
+    double cloudiness = 0.2;                                /* 0 to 0.9, drifts */
+    double loadDrift = 0;                                   /* W, drifts around the daily profile */
+    u64 gridDownUntil = 0;                                  /* ms */
+    u64 updatedAt = 0;                                      /* ms */
+
+    // everything below is recalculated by update(), in protocol units
+    bool gridUp = true;
+    bool loadConnected = true;
+    unsigned gridVoltage = 0, gridFreq = 0;
+    unsigned acOutputVoltage = 0, acOutputFreq = 0;
+    unsigned apparentPower = 0, activePower = 0, loadPercent = 0;
+    unsigned batteryVoltage = 0, sccVoltage = 0;
+    unsigned batteryChargeCurrent = 0, batteryDischargeCurrent = 0, batteryCapacity = 0;
+    unsigned heatSinkTemp = 0, mppt1Temp = 0, mppt2Temp = 0;
+    unsigned pv1Power = 0, pv2Power = 0, pv1Voltage = 0, pv2Voltage = 0;
+    unsigned mppt1Status = 0, mppt2Status = 0;
+    unsigned batteryDirection = 0, dcAcDirection = 0, lineDirection = 0;
+    unsigned workingMode = 0;
+
+    std::mt19937 rng{std::random_device{}()};
+
+    double uniform(double from, double to) {
+        return std::uniform_real_distribution<double>(from, to)(rng);
+    }
+
+    double noise(double stddev) {
+        return std::normal_distribution<double>(0, stddev)(rng);
+    }
+
+    bool chance(double p) {
+        return p > 0 && uniform(0, 1) < p;
+    }
+
+    time_t now() const {
+        return time(nullptr) + timeOffset;
+    }
+
+    void update();
+};
+
+static unsigned to_unsigned(double value) {
+    return value > 0 ? static_cast<unsigned>(lround(value)) : 0;
+}
+
+static unsigned date_key(const struct tm& tm) {
+    return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+// advances the model to the current time
+void SimulatorState::update() {
+    u64 ms = timestamp();
+    double dt = updatedAt ? std::min<double>(static_cast<double>(ms - updatedAt), 3600000) / 1000 : 0; /* s */
+    updatedAt = ms;
+
+    time_t t = now();
+    struct tm tm{};
+    localtime_r(&t, &tm);
+    double hour = tm.tm_hour + tm.tm_min / 60.0 + tm.tm_sec / 3600.0;
+
+    // an outage of 1 to 15 minutes every 12 hours or so
+    if (ms >= gridDownUntil && chance(dt / (12 * 3600)))
+        gridDownUntil = ms + static_cast<u64>(uniform(60, 900) * 1000);
+    gridUp = ms >= gridDownUntil;
+    bool utility = gridUp && acSupply;
+
+    // sun and weather
+    cloudiness = std::clamp(cloudiness + noise(0.01 * sqrt(dt)), 0.0, 0.9);
+    double sun = std::max(0.0, sin(M_PI * (hour - 6) / 12));
+    double pv1 = PV_PEAK_POWER * 0.55 * sun * (1 - cloudiness) * (1 + noise(0.01));
+    double pv2 = PV_PEAK_POWER * 0.45 * sun * (1 - cloudiness) * (1 + noise(0.01));
+    pv1 = std::max(0.0, pv1);
+    pv2 = std::max(0.0, pv2);
+    double pv = pv1 + pv2;
+
+    // household load, with morning and evening peaks
+    loadDrift = std::clamp(loadDrift + noise(5 * sqrt(dt)), -200.0, 400.0);
+    double load = 300
+        + 400 * exp(-pow(hour - 7.5, 2) / 2)
+        + 900 * exp(-pow(hour - 19.5, 2) / 3)
+        + loadDrift + noise(15);
+    load = std::clamp(load, 50.0, RATED_POWER);
+
+    // where the power comes from and goes to
+    double soc = batteryCharge / BATTERY_CAPACITY;
+    double voltage = 44 + 10 * soc;
+    double maxCharge = settings.maxChargeCurrent * voltage;
+    double charge = 0, discharge = 0, acCharge = 0, fromGrid = 0;
+
+    if (pv >= load) {
+        charge = soc < 1 ? std::min(pv - load, maxCharge) : 0;
+    } else {
+        // solar-utility-battery takes the rest from the grid, solar-battery-utility
+        // only does once the battery falls to the re-charge voltage
+        bool preferUtility = settings.outputSourcePriority == 0
+            || voltage * 10 <= settings.batteryRechargeVoltage;
+        if (utility && (preferUtility || soc <= 0))
+            fromGrid = load - pv;
+        else if (soc > 0)
+            discharge = load - pv;
+    }
+
+    loadConnected = utility || pv > 0 || soc > 0;
+    if (!loadConnected) {
+        load = 0;
+        discharge = 0;
+    }
+
+    bool acChargeAllowed = settings.chargeSourcePriority == 1
+        || (settings.chargeSourcePriority == 0 && pv == 0);
+    if (utility && acChargeAllowed && soc < 1) {
+        acCharge = std::min(settings.maxACChargeCurrent * voltage, std::max(0.0, maxCharge - charge));
+        charge += acCharge;
+        fromGrid += acCharge;
+    }
+
+    batteryCharge = std::clamp(batteryCharge + (charge - discharge) * dt / 3600, 0.0, BATTERY_CAPACITY);
+    generated[date_key(tm)] += pv * dt / 3600;
+
+    soc = batteryCharge / BATTERY_CAPACITY;
+    voltage = 44 + 10 * soc + (charge > 0 ? charge / maxCharge : 0) - (discharge > 0 ? discharge / RATED_POWER : 0);
+
+    // status
+    gridVoltage = gridUp ? to_unsigned(2300 + noise(15)) : 0;
+    gridFreq = gridUp ? to_unsigned(500 + noise(1)) : 0;
+    acOutputVoltage = loadConnected ? to_unsigned(settings.acOutputVoltage + noise(5)) : 0;
+    acOutputFreq = loadConnected ? to_unsigned(settings.acOutputFreq + noise(0.5)) : 0;
+    activePower = to_unsigned(load);
+    apparentPower = to_unsigned(load * 1.08);
+    loadPercent = to_unsigned(load * 1.08 * 100 / RATED_POWER);
+    batteryVoltage = to_unsigned(voltage * 10);
+    sccVoltage = pv > 0 ? batteryVoltage + 2 : 0;
+    batteryChargeCurrent = to_unsigned(charge / voltage);
+    batteryDischargeCurrent = to_unsigned(discharge / voltage);
+    batteryCapacity = to_unsigned(soc * 100);
+    heatSinkTemp = to_unsigned(28 + 25 * load / RATED_POWER + noise(0.5));
+    mppt1Temp = to_unsigned(28 + 20 * pv1 / PV_PEAK_POWER + noise(0.5));
+    mppt2Temp = to_unsigned(28 + 20 * pv2 / PV_PEAK_POWER + noise(0.5));
+    pv1Power = to_unsigned(pv1);
+    pv2Power = to_unsigned(pv2);
+    pv1Voltage = pv1 > 0 ? to_unsigned(3000 + 400 * sun + noise(20)) : to_unsigned(noise(20));
+    pv2Voltage = pv2 > 0 ? to_unsigned(2800 + 400 * sun + noise(20)) : to_unsigned(noise(20));
+    mppt1Status = pv1 > 0 ? (charge > acCharge ? 2 : 1) : 1;
+    mppt2Status = pv2 > 0 ? (charge > acCharge ? 2 : 1) : 1;
+    batteryDirection = charge > 0 ? 1 : (discharge > 0 ? 2 : 0);
+    dcAcDirection = acCharge > 0 ? 1 : (pv > 0 || discharge > 0 ? 2 : 0);
+    lineDirection = fromGrid > 0 ? 1 : 0;
+
+    if (!gridUp)
+        workingMode = 3;                    /* battery */
+    else if (pv > 0)
+        workingMode = 5;                    /* hybrid */
+    else if (fromGrid > 0)
+        workingMode = 2;                    /* bypass */
+    else
+        workingMode = 3;
+}
+
+
+/**
+ * Protocol
+ */
+
+// comma separated list of numbers, each zero-padded to its width
+class FieldList {
+private:
+    std::string s_;
+
+public:
+    FieldList& add(unsigned value, int width = 1) {
+        unsigned max = 1;
+        for (int i = 0; i < width; i++)
+            max *= 10;
+
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%0*u", width, std::min(value, max - 1));
+        return add(std::string(buf));
+    }
+
+    FieldList& add(const std::string& value) {
+        if (!s_.empty())
+            s_ += ',';
+        s_ += value;
+        return *this;
+    }
+
+    const std::string& str() const {
+        return s_;
+    }
+};
+
+static bool starts_with(const std::string& s, const char* prefix, std::string& rest) {
+    size_t len = strlen(prefix);
+    if (s.compare(0, len, prefix) != 0)
+        return false;
+    rest = s.substr(len);
+    return true;
+}
+
+// reads exactly len digits starting at pos
+static bool parse_digits(const std::string& s, size_t pos, size_t len, unsigned& out) {
+    if (pos + len > s.size())
+        return false;
+    out = 0;
+    for (size_t i = pos; i < pos + len; i++) {
+        if (!isdigit(static_cast<unsigned char>(s[i])))
+            return false;
+        out = out * 10 + (s[i] - '0');
+    }
+    return true;
+}
+
+// "nnn,nnn" and the like
+static bool parse_list(const std::string& s, size_t count, std::vector<unsigned>& out) {
+    out.clear();
+    size_t pos = 0;
+    while (pos <= s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == std::string::npos)
+            end = s.size();
+
+        unsigned n;
+        if (end == pos || !parse_digits(s, pos, end - pos, n))
+            return false;
+        out.push_back(n);
+        pos = end + 1;
+    }
+    return out.size() == count;
+}
+
+static std::string format_time_bucket(const std::array<unsigned, 4>& bucket) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%02u%02u,%02u%02u", bucket[0], bucket[1], bucket[2], bucket[3]);
+    return buf;
+}
+
+static bool parse_time_bucket(const std::string& s, std::array<unsigned, 4>& bucket) {
+    std::array<unsigned, 4> b{};
+    if (s.size() != 9 || s[4] != ','
+        || !parse_digits(s, 0, 2, b[0]) || !parse_digits(s, 2, 2, b[1])
+        || !parse_digits(s, 5, 2, b[2]) || !parse_digits(s, 7, 2, b[3]))
+        return false;
+    if (b[0] > 23 || b[1] > 59 || b[2] > 23 || b[3] > 59)
+        return false;
+    bucket = b;
+    return true;
+}
+
+static std::string format_energy(double wh) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08u", std::min(to_unsigned(wh), 99999999u));
+    return buf;
+}
+
+// sum of energy generated on the days whose yyyymmdd key starts with prefix
+static double generated_sum(const SimulatorState& s, unsigned prefix, unsigned divisor) {
+    double wh = 0;
+    for (const auto& [day, value]: s.generated) {
+        if (day / divisor == prefix)
+            wh += value;
+    }
+    return wh;
+}
+
+// data of a get command response, false if the command is unknown
+static bool answer_get(SimulatorState& s, const std::string& command, std::string& data) {
+    const auto& c = s.settings;
+    std::string arg;
+    unsigned n;
+
+    if (command == "PI") {
+        data = "18";
+    }
+
+    else if (command == "T") {
+        time_t t = s.now();
+        struct tm tm{};
+        localtime_r(&t, &tm);
+        char buf[16];
+        strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", &tm);
+        data = buf;
+    }
+
+    else if (command == "ET") {
+        data = format_energy(generated_sum(s, 0, 100000000));
+    }
+
+    else if (starts_with(command, "EY", arg) && arg.size() == 4 && parse_digits(arg, 0, 4, n)) {
+        data = format_energy(generated_sum(s, n, 10000));
+    }
+
+    else if (starts_with(command, "EM", arg) && arg.size() == 6 && parse_digits(arg, 0, 6, n)) {
+        data = format_energy(generated_sum(s, n, 100));
+    }
+
+    else if (starts_with(command, "ED", arg) && arg.size() == 8 && parse_digits(arg, 0, 8, n)) {
+        data = format_energy(generated_sum(s, n, 1));
+    }
+
+    else if (command == "ID") {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "%02zu", s.serialNumber.size());
+        data = buf + s.serialNumber;
+        data.resize(22, '0');
+    }
+
+    else if (command == "VFW") {
+        data = "05220,00000,00000";
+    }
+
+    else if (command == "PIRI") {
+        data = FieldList()
+            .add(2300, 4).add(217, 3).add(c.acOutputVoltage, 4).add(c.acOutputFreq, 3)
+            .add(217, 3).add(5000, 4).add(5000, 4).add(480, 3)
+            .add(c.batteryRechargeVoltage, 3).add(c.batteryRedischargeVoltage, 3)
+            .add(c.batteryUnderVoltage, 3).add(c.batteryBulkVoltage, 3).add(c.batteryFloatVoltage, 3)
+            .add(c.batteryType).add(c.maxACChargeCurrent, c.maxACChargeCurrent > 99 ? 3 : 2)
+            .add(c.maxChargeCurrent, 3).add(c.inputVoltageRange).add(c.outputSourcePriority)
+            .add(c.chargeSourcePriority).add(6 /* parallel max num */).add(c.flags[8])
+            .add(0 /* topology */).add(c.outputMode).add(c.solarPowerPriority).add(2 /* mppt */)
+            .str();
+    }
+
+    else if (command == "GS") {
+        data = FieldList()
+            .add(s.gridVoltage, 4).add(s.gridFreq, 3).add(s.acOutputVoltage, 4).add(s.acOutputFreq, 3)
+            .add(s.apparentPower, 4).add(s.activePower, 4).add(s.loadPercent, 3)
+            .add(s.batteryVoltage, 3).add(s.sccVoltage, 3).add(s.sccVoltage, 3)
+            .add(s.batteryDischargeCurrent, 3).add(s.batteryChargeCurrent, 3).add(s.batteryCapacity, 3)
+            .add(s.heatSinkTemp, 3).add(s.mppt1Temp, 3).add(s.mppt2Temp, 3)
+            .add(s.pv1Power, 4).add(s.pv2Power, 4).add(s.pv1Voltage, 4).add(s.pv2Voltage, 4)
+            .add(s.settingsChanged).add(s.mppt1Status).add(s.mppt2Status).add(s.loadConnected)
+            .add(s.batteryDirection).add(s.dcAcDirection).add(s.lineDirection).add(0 /* parallel id */)
+            .str();
+    }
+
+    else if (command == "MOD") {
+        data = FieldList().add(s.workingMode, 2).str();
+    }
+
+    else if (command == "FWS") {
+        data = FieldList()
+            .add(0, 2)
+            .add(!s.gridUp)
+            .add(0).add(0).add(0).add(0)
+            .add(s.batteryCapacity < 20)
+            .add(!s.loadConnected)
+            .add(s.loadPercent > 100)
+            .add(0).add(0).add(0).add(0).add(0).add(0).add(0).add(0)
+            .str();
+    }
+
+    else if (command == "FLAG") {
+        FieldList list;
+        for (bool flag: c.flags)
+            list.add(flag);
+        data = list.str();
+    }
+
+    else if (command == "DI") {
+        const auto& d = s.defaults;
+        data = FieldList()
+            .add(d.acOutputVoltage, 4).add(d.acOutputFreq, 3).add(d.inputVoltageRange)
+            .add(d.batteryUnderVoltage, 3).add(d.batteryFloatVoltage, 3).add(d.batteryBulkVoltage, 3)
+            .add(d.batteryRechargeVoltage, 3).add(d.batteryRedischargeVoltage, 3)
+            .add(d.maxChargeCurrent, 3).add(d.maxACChargeCurrent, 2).add(d.batteryType)
+            .add(d.outputSourcePriority).add(d.chargeSourcePriority).add(d.solarPowerPriority)
+            .add(d.flags[8]).add(d.outputMode)
+            /* buzzer, overload restart, over temp restart, backlight, alarm, fault code record,
+               overload bypass, lcd escape */
+            .add(d.flags[0]).add(d.flags[3]).add(d.flags[4]).add(d.flags[5]).add(d.flags[6])
+            .add(d.flags[7]).add(d.flags[1]).add(d.flags[2])
+            .str();
+    }
+
+    else if (command == "MCHGCR" || command == "MUCHGCR") {
+        FieldList list;
+        if (command == "MCHGCR") {
+            for (unsigned amps: allowed_charge_currents)
+                list.add(amps, 3);
+        } else {
+            for (unsigned amps: allowed_ac_charge_currents)
+                list.add(amps, 3);
+        }
+        data = list.str();
+    }
+
+    else if (starts_with(command, "PRI", arg) && !arg.empty() && parse_digits(arg, 0, arg.size(), n)) {
+        std::string serial = s.serialNumber;
+        serial.resize(20, '0');
+        data = FieldList()
+            .add(n == 0).add(static_cast<unsigned>(s.serialNumber.size()), 2).add(serial)
+            .add(c.chargeSourcePriority).add(c.maxChargeCurrent, 3)
+            .add(c.maxACChargeCurrent, c.maxACChargeCurrent > 99 ? 3 : 2).add(c.outputMode)
+            .str();
+    }
+
+    else if (starts_with(command, "PGS", arg) && !arg.empty() && parse_digits(arg, 0, arg.size(), n)) {
+        data = FieldList()
+            .add(n == 0).add(s.workingMode).add(0, 2)
+            .add(s.gridVoltage, 4).add(s.gridFreq, 3).add(s.acOutputVoltage, 4).add(s.acOutputFreq, 3)
+            .add(s.apparentPower, 4).add(s.activePower, 4).add(s.apparentPower, 5).add(s.activePower, 5)
+            .add(s.loadPercent, 3).add(s.loadPercent, 3)
+            .add(s.batteryVoltage, 3).add(s.batteryDischargeCurrent, 3).add(s.batteryChargeCurrent, 3)
+            .add(s.batteryChargeCurrent, 3).add(s.batteryCapacity, 3)
+            .add(s.pv1Power, 4).add(s.pv2Power, 4).add(s.pv1Voltage, 4).add(s.pv2Voltage, 4)
+            .add(s.mppt1Status).add(s.mppt2Status).add(s.loadConnected)
+            .add(s.batteryDirection).add(s.dcAcDirection).add(s.lineDirection)
+            .add(std::max({s.heatSinkTemp, s.mppt1Temp, s.mppt2Temp}), 3)
+            .str();
+    }
+
+    else if (command == "ACCT") {
+        data = format_time_bucket(s.acChargeTime);
+    }
+
+    else if (command == "ACLT") {
+        data = format_time_bucket(s.acSupplyTime);
+    }
+
+    else {
+        return false;
+    }
+
+    return true;
+}
+
+// applies a set command, false if it's unknown or its arguments are rejected
+static bool answer_set(SimulatorState& s, const std::string& command) {
+    auto& c = s.settings;
+    std::string arg;
+    std::vector<unsigned> list;
+    unsigned n;
+
+    if (starts_with(command, "LON", arg)) {
+        if (arg != "0" && arg != "1")
+            return false;
+        s.acSupply = arg == "1";
+        return true;
+    }
+
+    if (command == "PF") {
+        c = s.defaults;
+        s.settingsChanged = false;
+        return true;
+    }
+
+    if (starts_with(command, "MUCHGC", arg) || starts_with(command, "MCHGC", arg)) {
+        bool ac = command[1] == 'U';
+        if (!parse_list(arg, 2, list) || list[0] > 6)
+            return false;
+
+        if (ac) {
+            if (std::find(allowed_ac_charge_currents.begin(), allowed_ac_charge_currents.end(), list[1]) == allowed_ac_charge_currents.end())
+                return false;
+            c.maxACChargeCurrent = list[1];
+        } else {
+            if (std::find(allowed_charge_currents.begin(), allowed_charge_currents.end(), list[1]) == allowed_charge_currents.end())
+                return false;
+            c.maxChargeCurrent = list[1];
+        }
+    }
+
+    else if (starts_with(command, "MCHGV", arg)) {
+        if (!parse_list(arg, 2, list) || list[0] < 480 || list[0] > 584 || list[1] < 480 || list[1] > 584)
+            return false;
+        c.batteryBulkVoltage = list[0];
+        c.batteryFloatVoltage = list[1];
+    }
+
+    else if (starts_with(command, "BUCD", arg)) {
+        if (!parse_list(arg, 2, list))
+            return false;
+        c.batteryRechargeVoltage = list[0];
+        c.batteryRedischargeVoltage = list[1];
+    }
+
+    else if (starts_with(command, "POPM", arg)) {
+        if (!parse_list(arg, 2, list) || list[0] > 6 || list[1] > 4)
+            return false;
+        c.outputMode = list[1];
+    }
+
+    else if (starts_with(command, "POP", arg)) {
+        if (arg.size() != 1 || !parse_digits(arg, 0, 1, n) || n > 1)
+            return false;
+        c.outputSourcePriority = n;
+    }
+
+    else if (starts_with(command, "PCP", arg)) {
+        if (!parse_list(arg, 2, list) || list[0] > 6 || list[1] > 2)
+            return false;
+        c.chargeSourcePriority = list[1];
+    }
+
+    else if (starts_with(command, "PSDV", arg)) {
+        if (arg.size() != 3 || !parse_digits(arg, 0, 3, n) || n < 400 || n > 480)
+            return false;
+        c.batteryUnderVoltage = n;
+    }
+
+    else if (starts_with(command, "PSP", arg)) {
+        if (arg.size() != 1 || !parse_digits(arg, 0, 1, n) || n > 1)
+            return false;
+        c.solarPowerPriority = n;
+    }
+
+    else if (starts_with(command, "PGR", arg)) {
+        if (arg.size() != 1 || !parse_digits(arg, 0, 1, n) || n > 1)
+            return false;
+        c.inputVoltageRange = n;
+    }
+
+    else if (starts_with(command, "PBT", arg)) {
+        if (arg.size() != 1 || !parse_digits(arg, 0, 1, n) || n > 2)
+            return false;
+        c.batteryType = n;
+    }
+
+    else if (command.size() == 3 && (command[0] == 'P') && (command[1] == 'E' || command[1] == 'D')) {
+        if (command[2] < 'A' || command[2] > 'I')
+            return false;
+        c.flags[command[2] - 'A'] = command[1] == 'E';
+    }
+
+    else if (starts_with(command, "F", arg)) {
+        if (arg != "50" && arg != "60")
+            return false;
+        c.acOutputFreq = arg == "50" ? 500 : 600;
+    }
+
+    else if (starts_with(command, "V", arg)) {
+        if (arg.size() != 4 || !parse_digits(arg, 0, 4, n) || n < 2020 || n > 2400)
+            return false;
+        c.acOutputVoltage = n;
+    }
+
+    else if (starts_with(command, "ID", arg)) {
+        if (arg.size() != 22 || !parse_digits(arg, 0, 2, n) || n > 20)
+            return false;
+        s.serialNumber = arg.substr(2, n);
+        return true;
+    }
+
+    else if (command == "CLE") {
+        s.generated.clear();
+        return true;
+    }
+
+    else if (starts_with(command, "DAT", arg)) {
+        std::array<unsigned, 6> v{};
+        if (arg.size() != 12)
+            return false;
+        for (size_t i = 0; i < v.size(); i++) {
+            if (!parse_digits(arg, i * 2, 2, v[i]))
+                return false;
+        }
+
+        struct tm tm{};
+        tm.tm_year = static_cast<int>(v[0]) + 100;
+        tm.tm_mon = static_cast<int>(v[1]) - 1;
+        tm.tm_mday = static_cast<int>(v[2]);
+        tm.tm_hour = static_cast<int>(v[3]);
+        tm.tm_min = static_cast<int>(v[4]);
+        tm.tm_sec = static_cast<int>(v[5]);
+        tm.tm_isdst = -1;
+
+        time_t t = mktime(&tm);
+        if (t == -1)
+            return false;
+        s.timeOffset = t - time(nullptr);
+        return true;
+    }
+
+    else if (starts_with(command, "ACCT", arg)) {
+        return parse_time_bucket(arg, s.acChargeTime);
+    }
+
+    else if (starts_with(command, "ACLT", arg)) {
+        return parse_time_bucket(arg, s.acSupplyTime);
+    }
+
+    else {
+        return false;
+    }
+
+    s.settingsChanged = true;
+    return true;
+}
+
+
+/**
+ * Device
+ */
+
+SimulatedDevice::SimulatedDevice(const SimulatorFaults& faults)
+    : faults_(faults), state_(new SimulatorState) {
+    state_->update();
+}
+
+SimulatedDevice::~SimulatedDevice() = default;
+
+// returns the complete response frame, or an empty string if the device
+// wouldn't answer such a request at all
+std::string SimulatedDevice::respond(const std::string& request) {
+    // ^Pnnn or ^Snnn, then the command, crc and CR
+    size_t end = request.size() - 1;
+    if (flags_ & FLAG_WRITE_CRC) {
+        if (end < FRAME_HEADER_SIZE + sizeof(CRC))
+            return "";
+        end -= sizeof(CRC);
+
+        auto data = reinterpret_cast<const u8*>(request.data());
+        if (crc_read(&data[end]) != crc_calculate(data, end))
+            return "";
+    }
+
+    if (end <= FRAME_HEADER_SIZE || request[0] != '^' || (request[1] != 'P' && request[1] != 'S'))
+        return "";
+
+    std::string command = request.substr(FRAME_HEADER_SIZE, end - FRAME_HEADER_SIZE);
+    std::string frame;
+
+    state_->update();
+
+    std::string data;
+    if (request[1] == 'P' && answer_get(*state_, command, data)) {
+        char header[8];
+        snprintf(header, sizeof(header), "^D%03zu", data.size() + sizeof(CRC) + 1);
+        frame = header + data;
+    } else if (request[1] == 'S' && answer_set(*state_, command)) {
+        frame = "^1";
+    } else {
+        frame = "^0";
+    }
+
+    if (flags_ & FLAG_READ_CRC) {
+        u8 crc[sizeof(CRC)];
+        crc_write(crc_calculate(reinterpret_cast<const u8*>(frame.data()), frame.size()), crc);
+        frame.append(reinterpret_cast<const char*>(crc), sizeof(crc));
+    }
+    frame += '\r';
+
+    return frame;
+}
+
+void SimulatedDevice::inject(std::string& frame) {
+    SimulatorState& s = *state_;
+
+    if (s.chance(faults_.timeoutRate)) {
+        if (verbose_)
+            myerr << "simulating timeout";
+        frame.clear();
+        return;
+    }
+
+    if (s.chance(faults_.truncateRate)) {
+        size_t size = static_cast<size_t>(s.uniform(1, static_cast<double>(frame.size())));
+        if (verbose_)
+            myerr << "simulating truncated frame, " << size << " of " << frame.size() << " bytes";
+        frame.resize(size);
+    }
+
+    // anything but the marker and CR, so that the frame is still found and ends where it should
+    if (frame.size() > 3 && s.chance(faults_.crcErrorRate)) {
+        auto pos = static_cast<size_t>(s.uniform(2, static_cast<double>(frame.size() - 1)));
+        if (verbose_)
+            myerr << "simulating corrupted byte at " << pos;
+        frame[pos] = static_cast<char>(frame[pos] ^ (1 << static_cast<int>(s.uniform(0, 7))));
+    }
+}
+
+size_t SimulatedDevice::write(const u8* data, size_t dataSize) {
+    if (verbose_) {
+        myerr << "dataSize=" << dataSize;
+        std::cerr << hexdump((void*)data, dataSize);
+    }
+
+    input_.append(reinterpret_cast<const char*>(data), dataSize);
+
+    size_t cr;
+    while ((cr = input_.find('\r')) != std::string::npos) {
+        std::string request = input_.substr(0, cr + 1);
+        input_.erase(0, cr + 1);
+
+        std::string frame = respond(request);
+        if (frame.empty())
+            continue;
+        inject(frame);
+
+        double latency = static_cast<double>(faults_.latency);
+        if (faults_.jitter)
+            latency += state_->uniform(-1, 1) * static_cast<double>(faults_.jitter);
+
+        // like a real port, a response that's still on its way stays in line
+        // behind whatever hasn't been read yet
+        if (outputOffset_ == output_.size()) {
+            output_.clear();
+            outputOffset_ = 0;
+        }
+        output_ += frame;
+        readyAt_ = timestamp_us() + static_cast<u64>(std::max(0.0, latency) * 1000);
+    }
+
+    return dataSize;
+}
+
+size_t SimulatedDevice::read(u8* buf, size_t bufSize) {
+    u64 now = timestamp_us();
+    if (outputOffset_ == output_.size() || now < readyAt_) {
+        u64 wait = POLL_INTERVAL * 1000;
+        if (outputOffset_ != output_.size())
+            wait = std::min(wait, readyAt_ - now);
+        usleep(static_cast<useconds_t>(wait));
+        return 0;
+    }
+
+    size_t size = std::min(bufSize, output_.size() - outputOffset_);
+    memcpy(buf, &output_[outputOffset_], size);
+    outputOffset_ += size;
+
+    return size;
+}
+
+void SimulatedDevice::drain() {
+    // bytes that are still on their way can't be discarded yet
+    if (timestamp_us() < readyAt_)
+        return;
+    output_.clear();
+    outputOffset_ = 0;
+}
+
+}
@@ -8,17 +8,21 @@
 namespace voltronic {
 
 u64 timestamp() {
-    u64 ms = 0;
+    return timestamp_us() / 1000;
+}
+
+u64 timestamp_us() {
+    u64 us = 0;
 
 #if defined(CLOCK_MONOTONIC)
     static bool monotonic_clock_error = false;
     if (!monotonic_clock_error) {
         struct timespec ts = {0};
         if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
-            ms = static_cast<u64>(ts.tv_sec);
-            ms *= 1000;
-            ms += static_cast<u64>(ts.tv_nsec / 1000000);
-            return ms;
+            us = static_cast<u64>(ts.tv_sec);
+            us *= 1000000;
+            us += static_cast<u64>(ts.tv_nsec / 1000);
+            return us;
         } else {
             monotonic_clock_error = true;
         }
@@ -27,12 +31,18 @@ u64 timestamp() {
 
     struct timeval tv = {0};
     if (gettimeofday(&tv, nullptr) == 0) {
-        ms = static_cast<u64>(tv.tv_sec);
-        ms *= 1000;
-        ms += static_cast<u64>(tv.tv_usec / 1000);
+        us = static_cast<u64>(tv.tv_sec);
+        us *= 1000000;
+        us += static_cast<u64>(tv.tv_usec);
     }
 
-    return ms;
+    return us;
+}
+
+u64 unix_timestamp() {
+    struct timeval tv = {0};
+    gettimeofday(&tv, nullptr);
+    return static_cast<u64>(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
 }
 
-}
\ No newline at end of file
+}
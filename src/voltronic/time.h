@@ -8,6 +8,10 @@
 namespace voltronic {
 
 u64 timestamp();
+u64 timestamp_us();
+
+// wall clock, ms since epoch
+u64 unix_timestamp();
 
 }
 
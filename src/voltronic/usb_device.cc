@@ -3,6 +3,7 @@
 #include <stdexcept>
 #include <cstring>
 #include <iostream>
+#include <algorithm>
 
 #include "../logging.h"
 #include "device.h"
@@ -38,11 +39,23 @@ USBDevice::~USBDevice() {
 }
 
 size_t USBDevice::read(u8* buf, size_t bufSize) {
-    int timeout = !timeout_ ? -1 : static_cast<int32_t>(getTimeLeft());
-    const int bytesRead = hid_read_timeout(device_, buf, GET_HID_REPORT_SIZE(bufSize), timeout);
-    if (bytesRead == -1)
-        throw DeviceError("hidapi_read_timeout() failed");
-    return bytesRead;
+    // hidapi always reads whole reports and silently drops whatever doesn't
+    // fit, so read into our own buffer and keep the rest for the next call
+    if (reportOffset_ == reportSize_) {
+        int timeout = !timeout_ ? -1 : static_cast<int32_t>(getTimeLeft());
+        const int bytesRead = hid_read_timeout(device_, report_, HID_REPORT_SIZE, timeout);
+        if (bytesRead == -1)
+            throw DeviceError("hidapi_read_timeout() failed");
+
+        reportOffset_ = 0;
+        reportSize_ = bytesRead;
+    }
+
+    size_t size = std::min(bufSize, reportSize_ - reportOffset_);
+    memcpy(buf, &report_[reportOffset_], size);
+    reportOffset_ += size;
+
+    return size;
 }
 
 size_t USBDevice::write(const u8* data, size_t dataSize) {
@@ -63,6 +76,27 @@ size_t USBDevice::write(const u8* data, size_t dataSize) {
     return GET_HID_REPORT_SIZE(bytesWritten);
 }
 
+void USBDevice::drain() {
+    u8 report[HID_REPORT_SIZE];
+    size_t bytesDiscarded = reportSize_ - reportOffset_;
+
+    reportOffset_ = 0;
+    reportSize_ = 0;
+
+    // don't loop forever if the device keeps sending something
+    for (int i = 0; i < 64; i++) {
+        const int bytesRead = hid_read_timeout(device_, report, HID_REPORT_SIZE, 0);
+        if (bytesRead == -1)
+            throw DeviceError("hidapi_read_timeout() failed");
+        if (bytesRead == 0)
+            break;
+        bytesDiscarded += bytesRead;
+    }
+
+    if (verbose_ && bytesDiscarded)
+        myerr << "discarded " << bytesDiscarded << " bytes";
+}
+
 u16 USBDevice::GET_HID_REPORT_SIZE(size_t size) {
     return size > HID_REPORT_SIZE ? HID_REPORT_SIZE : size;
 }